@@ -0,0 +1,529 @@
+/**
+ * Nalloc microbenchmarks.
+ *
+ * Each benchmark runs in its own process, so that it starts from a fresh
+ * heap, once for each kind of tree: regular chunks ("nalloc"), chunks carved
+ * out of an arena ("arena"), chunks carved out of an arena mapped on huge
+ * pages ("huge") and compact chunks ("compact"). The allocation benchmarks
+ * also run against the system allocator ("libc") as a baseline.
+ *
+ * Shape benchmarks build a tree of a given shape, and report the time spent
+ * per node for building it and for tearing it down with a single nfree(),
+ * as well as the resident memory used per node. Operation benchmarks report
+ * the time per operation.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nalloc.h"
+
+#define NODE_SIZE 16
+
+enum kind { LIBC, NALLOC, ARENA, HUGE, COMPACT, KINDS };
+
+static const char *kinds[] = { "libc", "nalloc", "arena", "huge", "compact" };
+static enum kind kind;
+
+static void *root_new(void)
+{
+	switch (kind) {
+	case ARENA:
+		return nalloc_arena(NODE_SIZE, NULL, 0);
+	case HUGE:
+		return nalloc_arena_huge(NODE_SIZE, NULL, 0);
+	case COMPACT:
+		return nalloc_compact(NODE_SIZE, NULL);
+	default:
+		return nalloc(NODE_SIZE, NULL);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Resident memory of the process (in bytes). */
+static double rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages = 0;
+
+	if (f) {
+		if (fscanf(f, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+
+	return (double)pages * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t rnd(void)
+{
+	static uint64_t x = 88172645463325252ull;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+/* An array of n pointers, made resident before anything is measured. */
+static void **array(size_t n)
+{
+	void **mem = malloc(n * sizeof(*mem));
+
+	memset(mem, 0xff, n * sizeof(*mem));
+	return mem;
+}
+
+static double t0, t1, r0, r1;
+
+static void start(void)
+{
+	r0 = rss();
+	t0 = now();
+}
+
+static void built(void)
+{
+	t1 = now();
+	r1 = rss();
+}
+
+static void report(const char *name, size_t n)
+{
+	double t2 = now();
+
+	printf("%-7s %-16s %8zu  build %6.1f ns  free %6.1f ns  "
+	       "%6.1f bytes\n", kinds[kind], name, n, (t1 - t0) / n,
+	       (t2 - t1) / n, (r1 - r0) / n);
+}
+
+static void report_op(const char *name, size_t n, double t)
+{
+	printf("%-7s %-16s %8zu  %6.1f ns/op\n", kinds[kind], name, n,
+	       (now() - t) / n);
+}
+
+/* One root with `n` direct children. */
+static void bench_wide(size_t n)
+{
+	start();
+	void *root = root_new();
+
+	for (size_t i = 1; i < n; i++)
+		nalloc(NODE_SIZE, root);
+
+	built();
+	nfree(root);
+	report("wide", n);
+}
+
+/* A single chain `n` levels deep. */
+static void bench_deep(size_t n)
+{
+	start();
+	void *root = root_new(), *mem = root;
+
+	for (size_t i = 1; i < n; i++)
+		mem = nalloc(NODE_SIZE, mem);
+
+	built();
+	nfree(root);
+	report("deep", n);
+}
+
+/* A complete tree with the given fan-out, built breadth first. */
+static void bench_balanced(size_t n, size_t fanout)
+{
+	void **nodes = array(n);
+	char name[32];
+
+	start();
+	nodes[0] = root_new();
+
+	for (size_t i = 1; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, nodes[(i - 1) / fanout]);
+
+	built();
+	nfree(nodes[0]);
+
+	snprintf(name, sizeof(name), "balanced/%zu", fanout);
+	report(name, n);
+}
+
+static void bench_balanced_2(size_t n)
+{
+	bench_balanced(n, 2);
+}
+
+static void bench_balanced_16(size_t n)
+{
+	bench_balanced(n, 16);
+}
+
+/* Allocate `n` children of a root, then free them one by one. */
+static void bench_alloc(size_t n, bool zero)
+{
+	void **nodes = array(n), *root = NULL;
+
+	if (kind != LIBC)
+		root = root_new();
+
+	start();
+	for (size_t i = 0; i < n; i++) {
+		if (kind == LIBC)
+			nodes[i] = zero ? calloc(1, NODE_SIZE) :
+					  malloc(NODE_SIZE);
+		else
+			nodes[i] = zero ? ncalloc(NODE_SIZE, root) :
+					  nalloc(NODE_SIZE, root);
+	}
+	built();
+
+	for (size_t i = 0; i < n; i++) {
+		if (kind == LIBC)
+			free(nodes[i]);
+		else
+			nfree(nodes[i]);
+	}
+
+	report(zero ? "calloc" : "alloc", n);
+	nfree(root);
+}
+
+static void bench_malloc(size_t n)
+{
+	bench_alloc(n, false);
+}
+
+static void bench_calloc(size_t n)
+{
+	bench_alloc(n, true);
+}
+
+/* Short-lived children of a long-lived parent, freed right away. */
+static void bench_churn(size_t n)
+{
+	void *root = kind == LIBC ? NULL : root_new();
+	double t = now();
+
+	for (size_t i = 0; i < n; i++) {
+		if (kind == LIBC)
+			free(malloc(NODE_SIZE));
+		else
+			nfree(nalloc(NODE_SIZE, root));
+	}
+
+	report_op("churn", n, t);
+	nfree(root);
+}
+
+/*
+ * Resize `n` children of a root, either shrinking them a little, which
+ * does not move them, or growing them enough to move them.
+ */
+static void bench_realloc(size_t n, size_t size, const char *name)
+{
+	void **nodes = array(n), *root = kind == LIBC ? NULL : root_new();
+	double t;
+
+	for (size_t i = 0; i < n; i++)
+		nodes[i] = kind == LIBC ? malloc(NODE_SIZE) :
+					  nalloc(NODE_SIZE, root);
+
+	t = now();
+	for (size_t i = 0; i < n; i++)
+		nodes[i] = kind == LIBC ? realloc(nodes[i], size) :
+					  nrealloc(nodes[i], size);
+	report_op(name, n, t);
+
+	if (kind == LIBC)
+		for (size_t i = 0; i < n; i++)
+			free(nodes[i]);
+	nfree(root);
+}
+
+static void bench_realloc_inplace(size_t n)
+{
+	bench_realloc(n, NODE_SIZE - 8, "realloc/inplace");
+}
+
+static void bench_realloc_move(size_t n)
+{
+	bench_realloc(n, 1024, "realloc/move");
+}
+
+/* Grow a buffer below a root a few bytes at a time, up to 64 KiB. */
+static void bench_realloc_append(size_t n)
+{
+	void *root = kind == LIBC ? NULL : root_new();
+	char *buf = kind == LIBC ? malloc(NODE_SIZE) : nalloc(NODE_SIZE, root);
+	double t = now();
+
+	n = n < 4096 ? n : 4096;
+	for (size_t i = 1; i <= n; i++) {
+		buf = kind == LIBC ? realloc(buf, NODE_SIZE + i * 16) :
+				     nrealloc(buf, NODE_SIZE + i * 16);
+		buf[i * 16] = 0;
+	}
+	report_op("realloc/append", n, t);
+
+	if (kind == LIBC)
+		free(buf);
+	nfree(root);
+}
+
+/* Parent lookups of random nodes of a balanced tree. */
+static void bench_get_parent(size_t n)
+{
+	void **nodes = array(n);
+	double t;
+
+	nodes[0] = root_new();
+	for (size_t i = 1; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, nodes[(i - 1) / 16]);
+
+	t = now();
+	for (size_t i = 0; i < n; i++) {
+		size_t j = rnd() % (n - 1) + 1;
+
+		if (nalloc_get_parent(nodes[j]) != nodes[(j - 1) / 16])
+			abort();
+	}
+	report_op("get_parent", n, t);
+
+	nfree(nodes[0]);
+}
+
+/* Parent lookups of every child of a wide node. */
+static void bench_get_parent_wide(size_t n)
+{
+	void **nodes = array(n), *root = root_new();
+	double t;
+
+	n = n < 10000 ? n : 10000;
+	for (size_t i = 0; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, root);
+
+	t = now();
+	for (size_t i = 0; i < n; i++)
+		if (nalloc_get_parent(nodes[i]) != root)
+			abort();
+	report_op("get_parent/wide", n, t);
+
+	nfree(root);
+}
+
+/* Parent lookups of a single child, which cost little more than the call. */
+static void bench_get_parent_hot(size_t n)
+{
+	void *root = root_new(), *volatile node = nalloc(NODE_SIZE, root);
+	double t;
+
+	/* The volatile node keeps the lookup in the loop once inlined. */
+	t = now();
+	for (size_t i = 0; i < n; i++)
+		if (nalloc_get_parent(node) != root)
+			abort();
+	report_op("get_parent/hot", n, t);
+
+	nfree(root);
+}
+
+/* Move random nodes between 1024 groups. */
+static void bench_set_parent(size_t n)
+{
+	void **nodes = array(n), *groups[1024], *root = root_new();
+	double t;
+
+	for (size_t i = 0; i < 1024; i++)
+		groups[i] = nalloc(NODE_SIZE, root);
+	for (size_t i = 0; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, groups[i % 1024]);
+
+	t = now();
+	for (size_t i = 0; i < n; i++) {
+		if (i & 1)
+			nalloc_append(nodes[rnd() % n], groups[rnd() % 1024]);
+		else
+			nalloc_set_parent(nodes[rnd() % n],
+					  groups[rnd() % 1024]);
+	}
+	report_op("set_parent", n, t);
+
+	nfree(root);
+}
+
+/* Splice the children of a wide node into another wide node. */
+static void bench_cut(size_t n)
+{
+	void *root = root_new(), *mem = nalloc(NODE_SIZE, root);
+	double t;
+
+	n = n < 10000 ? n : 10000;
+	for (size_t i = 0; i < n; i++) {
+		nalloc(NODE_SIZE, root);
+		nalloc(NODE_SIZE, mem);
+	}
+
+	t = now();
+	nalloc_cut(mem, root);
+	report_op("cut/wide", 1, t);
+
+	nfree(mem);
+	nfree(root);
+}
+
+/*
+ * Cut random nodes of a balanced tree out of it, moving their children to
+ * their parent, and put them back as leaves. This includes a parent lookup.
+ */
+static void bench_cut_random(size_t n)
+{
+	void **nodes = array(n), *parent;
+	size_t ops = n / 10;
+	double t;
+
+	nodes[0] = root_new();
+	for (size_t i = 1; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, nodes[(i - 1) / 16]);
+
+	t = now();
+	for (size_t i = 0; i < ops; i++) {
+		void *mem = nodes[rnd() % (n - 1) + 1];
+
+		parent = nalloc_get_parent(mem);
+		nalloc_cut(mem, parent);
+		nalloc_set_parent(mem, parent);
+	}
+	report_op("cut/random", ops, t);
+
+	nfree(nodes[0]);
+}
+
+static int count_node(void *mem, void *ctx)
+{
+	(void)mem;
+	++*(size_t *)ctx;
+	return 0;
+}
+
+/*
+ * Walk a tree whose chunks were moved under random earlier chunks, so that
+ * siblings are spread over the heap, then walk it again once defragmented.
+ */
+static void bench_walk(size_t n)
+{
+	void **nodes = array(n);
+	size_t count = 0;
+	double t;
+
+	nodes[0] = root_new();
+	for (size_t i = 1; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, nodes[(i - 1) / 16]);
+	for (size_t i = 1; i < n; i++) {
+		size_t j = rnd() % (n - 1) + 1;
+
+		nalloc_set_parent(nodes[j], nodes[rnd() % j]);
+	}
+
+	t = now();
+	nalloc_walk(nodes[0], count_node, NULL, &count);
+	report_op("walk/random", count, t);
+
+	nodes[0] = nalloc_defrag(nodes[0]);
+	count = 0;
+	t = now();
+	nalloc_walk(nodes[0], count_node, NULL, &count);
+	report_op("walk/defrag", count, t);
+
+	nfree(nodes[0]);
+}
+
+/* Copy a balanced tree, then free the copy. */
+static void bench_clone(size_t n)
+{
+	void **nodes = array(n), *copy;
+	double t;
+
+	nodes[0] = root_new();
+	for (size_t i = 1; i < n; i++)
+		nodes[i] = nalloc(NODE_SIZE, nodes[(i - 1) / 16]);
+
+	t = now();
+	copy = nalloc_clone(nodes[0], NULL);
+	report_op("clone", n, t);
+
+	t = now();
+	nfree(copy);
+	report_op("clone/free", n, t);
+
+	nfree(nodes[0]);
+}
+
+static const struct {
+	void (*run)(size_t n);
+	bool baseline;
+} benches[] = {
+	{ bench_wide },
+	{ bench_deep },
+	{ bench_balanced_2 },
+	{ bench_balanced_16 },
+	{ bench_malloc, true },
+	{ bench_calloc, true },
+	{ bench_churn, true },
+	{ bench_realloc_inplace, true },
+	{ bench_realloc_move, true },
+	{ bench_realloc_append, true },
+	{ bench_get_parent },
+	{ bench_get_parent_wide },
+	{ bench_get_parent_hot },
+	{ bench_set_parent },
+	{ bench_cut },
+	{ bench_cut_random },
+	{ bench_walk },
+	{ bench_clone },
+};
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+#ifdef NALLOC_PARENT
+	printf("# parent links\n");
+#endif
+#if NALLOC_HARDEN
+	printf("# hardening tier %d\n", NALLOC_HARDEN);
+#endif
+#ifdef BENCH_BUILD
+	printf("# %s\n", BENCH_BUILD);
+#endif
+
+	for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); i++) {
+		for (kind = 0; kind < KINDS; kind++) {
+			if (kind == LIBC && !benches[i].baseline)
+				continue;
+
+			fflush(stdout);
+			if (!fork()) {
+				benches[i].run(n);
+				exit(0);
+			}
+			wait(NULL);
+		}
+	}
+
+	return 0;
+}
@@ -4,213 +4,4185 @@
  *
  * Each chunk of nalloc'ed memory has a header of the following form:
  *
- * +---------+---------+---------+--------···
- * |  first  |  next   |  prev   | memory
- * |  child  | sibling | sibling | chunk
- * +---------+---------+---------+--------···
+ * +---------+---------+---------+------+------+--------···
+ * |  first  |  next   |  prev   | size | meta | memory
+ * |  child  | sibling | sibling |      |      | chunk
+ * +---------+---------+---------+------+------+--------···
+ *
+ * The size and meta fields are 32 bits each. Meta holds the chunk flags in
+ * its top 12 bits, an auxiliary flag dependent value in the next 12 bits and
+ * the upper bits of the size in its low byte.
+ *
+ * Siblings form a list that is circular through its ends: the prev link of
+ * the first child points to the last one, and the next link of the last
+ * child points back to the parent, tagged with LAST_TAG. Both ends of a list
+ * are thus reachable in constant time, and so is the parent of either end.
+ * Finding the parent of any other chunk takes a walk to the last sibling.
+ * When built with NALLOC_PARENT, the header starts with an extra link to
+ * the parent of the chunk. When built with NALLOC_HARDEN, it starts with a
+ * canary word, ahead of the parent link if any.
  *
  * Thus, a nalloc hierarchy tree would look like this:
  *
  *   NULL <-- chunk --> NULL
- *              ^
- *              |
- *              +-> chunk <--> chunk <--> chunk --> NULL
- *                    |          |          ^
- *                    v          v          |
- *                   NULL       NULL        +-> chunk <--> chunk --> NULL
- *                                                |          |
- *                                                v          v
- *                                               NULL       NULL
+ *             ^ |
+ *             | +-> chunk <--> chunk <--> chunk --+
+ *             |      | ^                   ^  |   |
+ *             |      | +------ prev -------+  v   |
+ *             |      v                       chunk --+
+ *             |     NULL                      ^  ^   |
+ *             |                               +--+   |
+ *             +----------------- next ---------------+
+ *
+ * Here the last child of the chunk on the right is also its first one: its
+ * prev link points to itself, and its next link to its parent.
  */
 
+/* The library itself has no use for the fast paths of nalloc_inline.h. */
+#undef NALLOC_INLINE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <assert.h>
 
 #include "nalloc.h"
+#include "nalloc_inline.h"
 #include "util.h"
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#define raw_capacity(mem) malloc_usable_size(mem)
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 /**
  * Nalloc tree node helpers.
  */
 
-#define HEADER_SIZE (sizeof(void *) * 3)
+#ifdef NALLOC_PARENT
+#define HEADER_LINKS 4
+#else
+#define HEADER_LINKS 3
+#endif
+
+#ifdef NALLOC_PROFILE
+#define HEADER_SITES 1
+#else
+#define HEADER_SITES 0
+#endif
+
+#if NALLOC_HARDEN
+#define HEADER_WORDS (HEADER_LINKS + HEADER_SITES + 1)
+#else
+#define HEADER_WORDS (HEADER_LINKS + HEADER_SITES)
+#endif
+
+#define INFO_SIZE (sizeof(uint32_t) * 2)
+#define HEADER_SIZE (sizeof(void *) * HEADER_WORDS + INFO_SIZE)
+
+#define raw2usr(mem) (void *)((char *)(mem) + HEADER_SIZE)
+#define usr2raw(mem) (void *)((char *)(mem) - HEADER_SIZE)
+#define hdr_link(mem, i) (((void **)((char *)(mem) - INFO_SIZE))[-(i)])
+#define child(mem) hdr_link(mem, 3)
+#define next(mem) hdr_link(mem, 2)
+#define prev(mem) hdr_link(mem, 1)
+#ifdef NALLOC_PARENT
+#define parent(mem) hdr_link(mem, 4)
+#endif
+#ifdef NALLOC_PROFILE
+#define site(mem) hdr_link(mem, HEADER_LINKS + 1)
+#endif
+
+#define LAST_TAG ((uintptr_t)1)
+#define tag(mem) ((void *)((uintptr_t)(mem) | LAST_TAG))
+#define untag(mem) ((void *)((uintptr_t)(mem) & ~LAST_TAG))
 
-#define raw2usr(mem) (void *)((void **)(mem) + 3)
-#define usr2raw(mem) (void *)((void **)(mem)-3)
-#define child(mem) (((void **)(mem))[-3])
-#define next(mem) (((void **)(mem))[-2])
-#define prev(mem) (((void **)(mem))[-1])
-#define parent(mem) prev(mem) /* Valid only when is_first(mem) */
 #define is_root(mem) (!prev(mem))
-#define is_first(mem) (next(prev(mem)) != (mem))
+#define is_last(mem) ((uintptr_t)next(mem) & LAST_TAG)
+#define is_first(mem) is_last(prev(mem)) /* Valid only when !is_root(mem) */
+#define sibling(mem) (is_last(mem) ? NULL : next(mem))
+#define last(mem) prev(child(mem)) /* Valid only when child(mem) */
+
+#define size_lo(mem) (((uint32_t *)(mem))[-2])
+#define meta(mem) (((uint32_t *)(mem))[-1])
+#define aux(mem) ((meta(mem) >> 8) & 0xfff)
+#define set_aux(mem, val) (meta(mem) = (meta(mem) & ~0xfff00u) | (val) << 8)
+
+/* Chunk flags, stored in the top 12 bits of the meta field. */
+#define CHUNK_ARENA (1u << 20)        /* Carved out of an arena block. */
+#define CHUNK_ARENA_ROOT (1u << 21)   /* Owns the arena it is carved from. */
+#define CHUNK_ESCAPED (1u << 22)      /* Carved, but outside its arena tree. */
+#define CHUNK_FOREIGN (1u << 23)      /* Not carved, but below a carved chunk. */
+#define CHUNK_COMPACT (1u << 24)      /* Has a compact header. */
+#define CHUNK_COMPACT_ROOT (1u << 25) /* Owns a compact region. */
+#define CHUNK_ALIGNED (1u << 26)      /* Padded to a larger alignment. */
+#define CHUNK_CUSTOM (1u << 27)       /* From a custom backing allocator. */
+#define CHUNK_DESTRUCTOR (1u << 28)   /* Has a destructor. */
+#define CHUNK_SNAPSHOT (1u << 29)     /* Part of a mapped snapshot. */
+#define CHUNK_APPEND (1u << 30)       /* Children are allocated at the tail. */
+
+#define is_carved(mem) (meta(mem) & CHUNK_ARENA)
+#define in_compact(mem) (meta(mem) & (CHUNK_COMPACT | CHUNK_COMPACT_ROOT))
+#define appends(parent) ((parent) && unlikely(meta(parent) & CHUNK_APPEND))
+
+/* The allocation site of a chunk, only recorded with NALLOC_PROFILE. */
+#ifdef NALLOC_PROFILE
+#define get_site(mem) \
+	(meta(mem) & CHUNK_COMPACT ? NULL : (const char *)site(mem))
+#define set_site(mem, tag) (site(mem) = (void *)(tag))
+#else
+#define get_site(mem) ((const char *)NULL)
+#define set_site(mem, tag) ((void)(tag))
+#endif
+
+/* Largest chunk size representable in the header. */
+#if SIZE_MAX > 0xffffffffffu
+#define MAX_SIZE ((size_t)0xffffffffffu)
+#else
+#define MAX_SIZE (SIZE_MAX / 2)
+#endif
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+static inline size_t chunk_size(const void *mem)
+{
+	return (size_t)((uint64_t)(meta(mem) & 0xff) << 32 | size_lo(mem));
+}
+
+static inline void set_size(void *mem, size_t size)
+{
+	size_lo(mem) = (uint32_t)size;
+	meta(mem) = (meta(mem) & ~0xffu) | (uint32_t)((uint64_t)size >> 32);
+}
+
+/*
+ * Compact header links, see the compact arena section below. A link holds
+ * the low 32 bits of the address of a chunk of the same region, or 0.
+ */
+#define COMPACT_HEADER (sizeof(uint32_t) * 4)
+#define COMPACT_MAX_SIZE 0xfffffu
+
+#define compact_link(mem, i) (((uint32_t *)(mem))[-(i)])
+#define compact_child(mem) compact_link(mem, 4)
+#define compact_next(mem) compact_link(mem, 3)
+#define compact_prev(mem) compact_link(mem, 2)
+#define compact_size(mem) (meta(mem) & COMPACT_MAX_SIZE)
+
+#define compact_base(mem) ((uintptr_t)(mem) & ~(uintptr_t)UINT32_MAX)
+#define compact_off(mem) ((uint32_t)(uintptr_t)(mem))
+#define compact_ptr(mem, off) \
+	((void *)(compact_base(mem) | ((off) & ~(uint32_t)LAST_TAG)))
+
+/**
+ * Hardening.
+ *
+ * NALLOC_HARDEN selects a tier of checks, each including the previous ones:
+ *
+ *   1. The first header word of regular chunks holds a per-process canary,
+ *      checked by nfree(), nrealloc() and nalloc_set_parent(), and cycles
+ *      met while freeing a tree abort instead of being merely asserted.
+ *   2. Freed chunks are poisoned, and nalloc_set_parent() and the like refuse
+ *      to make a chunk its own descendant.
+ *   3. Freed chunks from the system allocator go through a quarantine, and
+ *      their poison is checked when they leave it.
+ *
+ * Compact chunks have no canary.
+ */
+
+#ifndef NALLOC_HARDEN
+#define NALLOC_HARDEN 0
+#endif
+
+#if NALLOC_HARDEN
+#define canary(mem) hdr_link(mem, HEADER_WORDS)
+
+static uintptr_t canary_key;
+
+static __attribute__((constructor)) void canary_init(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	canary_key = ((uintptr_t)&canary_key ^ (uintptr_t)ts.tv_nsec *
+		      0x9e3779b97f4a7c15u) | 1;
+}
+
+static COLD __attribute__((noreturn)) void harden_fail(const char *what,
+						      const void *mem)
+{
+	fprintf(stderr, "nalloc: %s at %p\n", what, mem);
+	abort();
+}
+
+static inline void check_chunk(const void *mem)
+{
+	if (!(meta(mem) & CHUNK_COMPACT) &&
+	    unlikely((uintptr_t)canary(mem) != canary_key))
+		harden_fail((uintptr_t)canary(mem) == ~canary_key ?
+			    "double free" : "corrupted header", mem);
+}
+
+#define set_canary(mem) (canary(mem) = (void *)canary_key)
+#else
+#define check_chunk(mem) ((void)0)
+#define set_canary(mem) ((void)0)
+#endif
+
+/**
+ * Unlink a memory chunk from its parent and siblings, and make it the first
+ * or last child of parent. No arena bookkeeping is done here.
+ *
+ * @param mem     pointer to allocated memory chunk.
+ * @param parent  pointer to allocated memory chunk, or NULL.
+ * @param append  whether to insert the chunk after the last child of parent.
+ */
+static inline void __set_parent(void *mem, void *parent, bool append)
+{
+	if (!is_root(mem)) {
+		/* Remove node from old tree. */
+		void *prev = prev(mem), *next = next(mem);
+
+		if (prev == mem)
+			child(untag(next)) = NULL;
+		else {
+			if (is_last(prev))
+				child(untag(next(prev))) = next;
+			else
+				next(prev) = next;
+
+			if (is_last(mem))
+				prev(child(untag(next))) = prev;
+			else
+				prev(next) = prev;
+		}
+	}
+
+	next(mem) = prev(mem) = NULL;
+#ifdef NALLOC_PARENT
+	parent(mem) = parent;
+#endif
+
+	if (parent) {
+		/* Insert node into new tree. */
+		void *first = child(parent);
+
+		if (!first) {
+			next(mem) = tag(parent);
+			prev(mem) = mem;
+			child(parent) = mem;
+		} else if (!append) {
+			next(mem) = first;
+			prev(mem) = prev(first);
+			prev(first) = mem;
+			child(parent) = mem;
+		} else {
+			next(mem) = tag(parent);
+			prev(mem) = prev(first);
+			next(prev(first)) = mem;
+			prev(first) = mem;
+		}
+	}
+}
+
+/**
+ * Update all the references to a memory chunk that moved.
+ *
+ * @param mem  new address of the memory chunk.
+ * @param usr  old address of the memory chunk, no longer accessible.
+ */
+static inline void relink(void *mem, const void *usr)
+{
+	void *child = child(mem);
+
+	if (child && unlikely(meta(child) & CHUNK_COMPACT)) {
+		/* Only the last child of a compact root links back to it. */
+		compact_next(compact_ptr(child, compact_prev(child))) =
+			compact_off(mem) | LAST_TAG;
+		child = NULL;
+	} else if (child)
+		next(last(mem)) = tag(mem);
+
+#ifdef NALLOC_PARENT
+	for (; child; child = sibling(child))
+		parent(child) = mem;
+#endif
+
+	if (is_root(mem))
+		return;
+
+	if (prev(mem) == usr) {
+		prev(mem) = mem;
+		child(untag(next(mem))) = mem;
+		return;
+	}
+
+	if (is_last(mem))
+		prev(child(untag(next(mem)))) = mem;
+	else
+		prev(next(mem)) = mem;
+
+	if (is_first(mem))
+		child(untag(next(prev(mem)))) = mem;
+	else
+		next(prev(mem)) = mem;
+}
 
 /**
  * Initialize a raw chunk of memory.
  *
  * @param mem     pointer to a raw memory chunk.
+ * @param size    amount of usable memory in the chunk (in bytes).
+ * @param aux     auxiliary value of the chunk.
  * @param parent  pointer to previously nalloc'ed memory chunk from which this
  *                chunk depends, or NULL.
  *
  * @return pointer to the allocated memory chunk, or NULL if there was an error.
  */
-static inline void *nalloc_init(void *mem, void *parent)
+static inline void *nalloc_init(void *mem, size_t size, unsigned aux,
+				void *parent)
 {
 	if (unlikely(!mem))
 		return NULL;
 
 	memset(mem, 0, HEADER_SIZE);
 	mem = raw2usr(mem);
+	set_canary(mem);
+	set_size(mem, size);
+	set_aux(mem, aux);
 
-	nalloc_set_parent(mem, parent);
+	__set_parent(mem, parent, false);
 	return mem;
 }
 
-EXPORT
-void *nalloc(size_t size, void *parent)
+/**
+ * Size-class cache.
+ *
+ * Small raw chunks are allocated rounded up to a multiple of CACHE_GRAIN,
+ * and once freed they are kept on a per-class free list, threaded through
+ * their first word, to be reused by the next allocation of the same class.
+ * The recorded chunk size is enough to find its class again, since every
+ * small chunk is requested from (and resized through) the system allocator
+ * with its class size.
+ *
+ * Each thread keeps a magazine of chunks per class in front of the shared
+ * free lists, refilled from and flushed to them half a magazine at a time.
+ * Small chunks record the id of the thread that allocated them in the aux
+ * field, and a chunk freed by another thread is pushed on the lock-free
+ * remote free queue of its owner, which drains it into its magazines when
+ * they run empty. Thread caches are never freed: when a thread exits its
+ * chunks go to the shared free lists, and its id (along with its queue) is
+ * handed over to the next thread that starts allocating.
+ *
+ * The thread caches are declared in nalloc_inline.h, along with the fast
+ * paths that use them when the program is built with NALLOC_INLINE.
+ */
+
+#define CACHE_GRAIN NALLOC__CACHE_GRAIN
+#define CACHE_CLASSES NALLOC__CACHE_CLASSES
+#define CACHE_MAX NALLOC__CACHE_MAX
+#define CACHE_DEFAULT_LIMIT (1 << 20)
+#define MAG_SIZE NALLOC__MAG_SIZE
+#define MAX_THREADS 1024
+
+#define size2class(size) (((size) - 1) / CACHE_GRAIN)
+#define class2size(class) (((class) + 1) * CACHE_GRAIN)
+
+static struct {
+	pthread_mutex_t lock;
+	void *free[CACHE_CLASSES];
+	size_t bytes, limit;
+} cache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, CACHE_DEFAULT_LIMIT };
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	pthread_key_t key;
+	unsigned count;
+	struct nalloc__tcache *all[MAX_THREADS + 1];
+} threads = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+
+EXPORT _Thread_local struct nalloc__tcache *nalloc__self;
+#define self nalloc__self
+
+/* The fast paths of nalloc_inline.h rely on this layout. */
+_Static_assert(NALLOC__HEADER_SIZE == HEADER_SIZE, "header size");
+_Static_assert(NALLOC__COMPACT == CHUNK_COMPACT, "compact flag");
+_Static_assert(NALLOC__SLOW_PARENT ==
+		       (CHUNK_ARENA | CHUNK_COMPACT | CHUNK_COMPACT_ROOT |
+			CHUNK_CUSTOM | CHUNK_APPEND),
+	       "slow parent flags");
+_Static_assert(MAX_THREADS < 1 << 12, "thread ids fit the aux field");
+
+/* Named after the build options, see nalloc_inline.h. */
+EXPORT const char NALLOC__ABI = 0;
+static _Thread_local bool attached;
+
+static void free_list(void *mem)
 {
-	return nalloc_init(malloc(size + HEADER_SIZE), parent);
+	for (void *next; mem; mem = next) {
+		next = *(void **)mem;
+		free(mem);
+	}
 }
 
-EXPORT
-void *ncalloc(size_t size, void *parent)
+/**
+ * Push chunks of a class on the shared free list, up to the cache limit.
+ * The chunks that do not fit are given back to the system allocator.
+ */
+static void shared_put(void **mem, unsigned count, unsigned class)
 {
-	return nalloc_init(calloc(1, size + HEADER_SIZE), parent);
+	size_t size = class2size(class);
+	unsigned i = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	for (; i < count && cache.bytes + size <= cache.limit; i++) {
+		*(void **)mem[i] = cache.free[class];
+		cache.free[class] = mem[i];
+		cache.bytes += size;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	while (i < count)
+		free(mem[i++]);
 }
 
-EXPORT
-void *nrealloc(void *usr, size_t size)
+static inline void tcache_put(struct nalloc__tcache *t, void *mem,
+			      unsigned class)
 {
-	void *mem = realloc(usr ? usr2raw(usr) : NULL, size + HEADER_SIZE);
+	if (unlikely(t->count[class] == MAG_SIZE)) {
+		shared_put(&t->mag[class][MAG_SIZE / 2], MAG_SIZE / 2, class);
+		t->count[class] = MAG_SIZE / 2;
+	}
 
-	if (unlikely(!usr || !mem))
-		return nalloc_init(mem, NULL);
+	t->mag[class][t->count[class]++] = mem;
+}
 
-	mem = raw2usr(mem);
+static void remote_push(struct nalloc__tcache *t, void *mem)
+{
+	void *head = atomic_load_explicit(&t->remote, memory_order_relaxed);
 
-	/* If the buffer starting address changed, update all references. */
-	if (mem != usr) {
-		if (child(mem))
-			parent(child(mem)) = mem;
+	do
+		*(void **)mem = head;
+	while (!atomic_compare_exchange_weak_explicit(&t->remote, &head, mem,
+						      memory_order_release,
+						      memory_order_relaxed));
+}
 
-		if (!is_root(mem)) {
-			if (next(mem))
-				prev(next(mem)) = mem;
+/**
+ * Move chunks freed by other threads to the magazines of their owner.
+ */
+static void tcache_drain(struct nalloc__tcache *t)
+{
+	void *mem = atomic_exchange_explicit(&t->remote, NULL,
+					     memory_order_acquire);
 
-			if (next(prev(mem)) == usr)
-				next(prev(mem)) = mem;
+	for (void *next; mem; mem = next) {
+		next = *(void **)mem;
+		tcache_put(t, mem, size2class(chunk_size(raw2usr(mem)) +
+					      HEADER_SIZE));
+	}
+}
 
-			if (child(parent(mem)) == usr)
-				child(parent(mem)) = mem;
-		}
+static COLD unsigned tcache_refill(struct nalloc__tcache *t, unsigned class)
+{
+	void *mem;
+
+	tcache_drain(t);
+
+	if (t->count[class])
+		return t->count[class];
+
+	pthread_mutex_lock(&cache.lock);
+	while (t->count[class] < MAG_SIZE / 2 && (mem = cache.free[class])) {
+		cache.free[class] = *(void **)mem;
+		cache.bytes -= class2size(class);
+		t->mag[class][t->count[class]++] = mem;
 	}
+	pthread_mutex_unlock(&cache.lock);
 
-	return mem;
+	return t->count[class];
+}
+
+static void tcache_detach(void *arg)
+{
+	struct nalloc__tcache *t = arg;
+
+	tcache_drain(t);
+
+	for (unsigned class = 0; class < CACHE_CLASSES; class++) {
+		shared_put(t->mag[class], t->count[class], class);
+		t->count[class] = 0;
+	}
+
+	pthread_mutex_lock(&threads.lock);
+	t->used = false;
+	pthread_mutex_unlock(&threads.lock);
+
+	self = NULL;
+}
+
+static void tcache_key_init(void)
+{
+	pthread_key_create(&threads.key, tcache_detach);
 }
 
 /**
- * Deallocate all the descendants of parent(mem) recursively.
- *
- * @param mem  pointer to previously nalloc'ed memory chunk.
+ * Give the calling thread a cache, reusing the one of an exited thread if
+ * possible. Threads past MAX_THREADS use the shared free lists only.
  */
-static inline void __nfree(void *mem)
+static COLD struct nalloc__tcache *tcache_attach(void)
 {
-	if (unlikely(!mem))
-		return;
+	struct nalloc__tcache *t = NULL;
+
+	attached = true;
+	pthread_once(&threads.once, tcache_key_init);
+
+	pthread_mutex_lock(&threads.lock);
+	for (unsigned id = 1; id <= threads.count && !t; id++)
+		if (!threads.all[id]->used)
+			t = threads.all[id];
+
+	if (!t && threads.count < MAX_THREADS && (t = calloc(1, sizeof(*t)))) {
+		t->id = ++threads.count;
+		threads.all[t->id] = t;
+	}
+
+	if (t)
+		t->used = true;
+	pthread_mutex_unlock(&threads.lock);
 
-	/* Fail if the tree hierarchy has cycles. */
-	assert(prev(mem));
-	prev(mem) = NULL;
+	if (t)
+		pthread_setspecific(threads.key, t);
 
-	__nfree(child(mem));
-	__nfree(next(mem));
-	free(usr2raw(mem));
+	return self = t;
 }
 
-EXPORT
-void *nfree(void *mem)
+static inline struct nalloc__tcache *tcache(void)
 {
-	if (unlikely(!mem))
-		return NULL;
+	if (unlikely(!self) && !attached)
+		return tcache_attach();
+
+	return self;
+}
+
+/**
+ * Allocate a raw chunk, from the cache if possible.
+ *
+ * @param size  raw size of the chunk, header included (in bytes).
+ * @param zero  whether the chunk should be zeroed.
+ */
+static inline void *raw_alloc(size_t size, bool zero)
+{
+	if (size <= CACHE_MAX) {
+		unsigned class = size2class(size);
+		struct nalloc__tcache *t = tcache();
+		void *mem = NULL;
+
+		size = class2size(class);
 
-	nalloc_set_parent(mem, NULL);
+		if (likely(t)) {
+			if (likely(t->count[class]) || tcache_refill(t, class))
+				mem = t->mag[class][--t->count[class]];
+		} else {
+			pthread_mutex_lock(&cache.lock);
+			if ((mem = cache.free[class])) {
+				cache.free[class] = *(void **)mem;
+				cache.bytes -= size;
+			}
+			pthread_mutex_unlock(&cache.lock);
+		}
 
-	__nfree(child(mem));
-	free(usr2raw(mem));
+		if (mem)
+			return zero ? memset(mem, 0, size) : mem;
+	}
 
-	return NULL;
+	return zero ? calloc(1, size) : malloc(size);
 }
 
-EXPORT
-void *nalloc_get_parent(const void *mem)
+/**
+ * Resize a raw chunk, in place when it still fits in its block.
+ *
+ * When the system allocator reports the usable size of its blocks, a chunk
+ * stays in place as long as its block holds hint bytes and it does not
+ * shrink to less than half of it. A chunk that moves gets a block of hint
+ * bytes if possible, and one that grows by less than half of its size gets
+ * half of its size more, so that a series of small grows mostly happens in
+ * place. Small chunks must fit the block with their class size, since that
+ * is what the cache hands them out as once freed. Otherwise, only small
+ * chunks staying in the same class are kept in place, and hint is ignored.
+ *
+ * @param mem   pointer to a raw memory chunk.
+ * @param old   raw size of the chunk (in bytes).
+ * @param size  new raw size of the chunk (in bytes).
+ * @param hint  raw size to make room for, at least size.
+ */
+static inline void *raw_realloc(void *mem, size_t old, size_t size,
+				size_t hint)
 {
-	if (unlikely(!mem || is_root(mem)))
-		return NULL;
+#ifdef raw_capacity
+	size_t capacity = raw_capacity(mem);
+	void *new;
+#endif
 
-	while (!is_first(mem))
-		mem = prev(mem);
+	if (size <= CACHE_MAX)
+		size = class2size(size2class(size));
 
-	return parent(mem);
+#ifdef raw_capacity
+	if (hint < size)
+		hint = size;
+
+	if (hint <= capacity && (size >= old || size >= capacity / 2))
+		return mem;
+
+	if (size > old && size - old < old / 2 && hint < old + old / 2)
+		hint = old + old / 2;
+
+	if (hint > size && (new = realloc(mem, hint)))
+		return new;
+#else
+	if (old <= CACHE_MAX && size == class2size(size2class(old)))
+		return mem;
+
+	(void)hint;
+#endif
+
+	return realloc(mem, size);
 }
 
-EXPORT
-void nalloc_set_parent(void *mem, void *parent)
+/**
+ * Release a raw chunk, to the cache if there is room left.
+ *
+ * @param mem    pointer to a raw memory chunk.
+ * @param size   raw size of the chunk, header included (in bytes).
+ * @param owner  id of the thread that allocated the chunk, or 0.
+ */
+static inline void raw_free(void *mem, size_t size, unsigned owner)
 {
-	if (unlikely(!mem))
-		return;
+	if (size <= CACHE_MAX) {
+		unsigned class = size2class(size);
+		struct nalloc__tcache *t = tcache();
 
-	if (!is_root(mem)) {
-		/* Remove node from old tree. */
-		if (next(mem))
-			prev(next(mem)) = prev(mem);
-
-		if (!is_first(mem))
-			next(prev(mem)) = next(mem);
+		if (owner && (unlikely(!t) || owner != t->id))
+			remote_push(threads.all[owner], mem);
+		else if (likely(t))
+			tcache_put(t, mem, class);
 		else
-			child(parent(mem)) = next(mem);
+			shared_put(&mem, 1, class);
+
+		return;
 	}
 
-	next(mem) = prev(mem) = NULL;
+	free(mem);
+}
 
-	if (parent) {
-		/* Insert node into new tree. */
+/**
+ * Give cached chunks back to the system allocator until at most limit
+ * bytes are left in the shared free lists.
+ */
+static void cache_shrink(size_t limit)
+{
+	void *list = NULL, *mem;
 
-		if (child(parent)) {
-			next(mem) = child(parent);
-			prev(child(parent)) = mem;
+	pthread_mutex_lock(&cache.lock);
+	for (unsigned class = CACHE_CLASSES; class-- && cache.bytes > limit;) {
+		while (cache.bytes > limit && (mem = cache.free[class])) {
+			cache.free[class] = *(void **)mem;
+			cache.bytes -= class2size(class);
+
+			*(void **)mem = list;
+			list = mem;
 		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	free_list(list);
+}
+
+/**
+ * Backing allocators.
+ *
+ * Allocators other than the system one are registered in a table the first
+ * time they are used, and never removed, so that chunks refer to them with
+ * a small id. Id 0 is the system allocator. Regular chunks from a custom
+ * allocator bypass the cache, are flagged as custom and keep its id in the
+ * aux field instead of the id of their thread. Aligned chunks keep it above
+ * log2 of their alignment, and arenas in their descriptor.
+ */
+
+#define MAX_BACKENDS 63
+#define BACKEND_SHIFT 6
+
+static struct {
+	pthread_mutex_t lock;
+	_Atomic unsigned count, global;
+	const struct nalloc_allocator *ops[MAX_BACKENDS + 1];
+} backends = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Find the id of an allocator, registering it if needed.
+ *
+ * @return the allocator id, or -1 if there was an error.
+ */
+static int backend_id(const struct nalloc_allocator *ops)
+{
+	unsigned count, id;
+
+	if (!ops)
+		return 0;
 
-		parent(mem) = parent;
-		child(parent) = mem;
+	count = atomic_load_explicit(&backends.count, memory_order_acquire);
+	for (id = 1; id <= count; id++)
+		if (backends.ops[id] == ops)
+			return id;
+
+	if (!ops->malloc || !ops->realloc || !ops->memalign || !ops->free)
+		return -1;
+
+	pthread_mutex_lock(&backends.lock);
+	count = atomic_load_explicit(&backends.count, memory_order_relaxed);
+	for (id = 1; id <= count && backends.ops[id] != ops; id++)
+		;
+
+	if (id > MAX_BACKENDS)
+		id = -1;
+	else if (id > count) {
+		backends.ops[id] = ops;
+		atomic_store_explicit(&backends.count, id,
+				      memory_order_release);
 	}
+	pthread_mutex_unlock(&backends.lock);
+
+	return id;
 }
 
-EXPORT
-void nalloc_cut(void *mem, void *parent)
+/* The allocator of the chunks allocated without a parent. */
+static inline unsigned default_backend(void)
 {
-	if (unlikely(!mem))
-		return;
+	return atomic_load_explicit(&backends.global, memory_order_acquire);
+}
 
-	nalloc_set_parent(mem, NULL);
+static void *backend_alloc(unsigned id, size_t size, bool zero)
+{
+	const struct nalloc_allocator *ops = backends.ops[id];
+	void *mem;
 
-	if (!child(mem))
-		return;
+	if (!zero)
+		return ops->malloc(ops->ctx, size);
 
-	if (parent) {
-		/* Insert mem children in front of the list of parent children. */
-		if (child(parent)) {
-			void *last = child(mem);
+	if (ops->calloc)
+		return ops->calloc(ops->ctx, size);
 
-			while (next(last))
-				last = next(last);
+	if ((mem = ops->malloc(ops->ctx, size)))
+		memset(mem, 0, size);
 
-			prev(child(parent)) = last;
-			next(last) = child(parent);
-		}
+	return mem;
+}
+
+static void *backend_memalign(unsigned id, size_t align, size_t size)
+{
+	void *mem;
+
+	if (id)
+		return backends.ops[id]->memalign(backends.ops[id]->ctx, align,
+						  size);
+
+	return posix_memalign(&mem, align, size) ? NULL : mem;
+}
+
+static void backend_free(unsigned id, void *mem)
+{
+	if (id)
+		backends.ops[id]->free(backends.ops[id]->ctx, mem);
+	else
+		free(mem);
+}
+
+/**
+ * Allocate a regular chunk from a given allocator.
+ */
+static void *backend_chunk(size_t size, void *parent, unsigned id, bool zero)
+{
+	void *mem;
 
-		child(parent) = child(mem);
+	if (!id) {
+		mem = raw_alloc(size + HEADER_SIZE, zero);
+		return nalloc_init(mem, size, self ? self->id : 0, parent);
 	}
 
-	parent(child(mem)) = parent;
-	child(mem) = NULL;
+	mem = backend_alloc(id, size + HEADER_SIZE, zero);
+	if (!(mem = nalloc_init(mem, size, id, parent)))
+		return NULL;
+
+	meta(mem) |= CHUNK_CUSTOM;
+	return mem;
+}
+
+static void *backend_realloc(void *usr, size_t size)
+{
+	const struct nalloc_allocator *ops = backends.ops[aux(usr)];
+	void *mem;
+
+	if (!(mem = ops->realloc(ops->ctx, usr2raw(usr), size + HEADER_SIZE)))
+		return NULL;
+
+	mem = raw2usr(mem);
+	set_size(mem, size);
+
+	if (mem != usr)
+		relink(mem, usr);
+
+	return mem;
+}
+
+/**
+ * Arena-backed trees.
+ *
+ * An arena is a list of power-of-two sized blocks, each aligned to its own
+ * size, out of which chunks are carved with a bump pointer. Carved chunks
+ * keep log2 of their block size in the aux field, so the block (and from
+ * there the arena) is found by masking the chunk address.
+ *
+ * The arena is owned by its root chunk. Chunks allocated below a carved
+ * chunk are carved from the same arena, so as long as nothing is moved in
+ * or out, freeing the root releases the blocks without visiting the tree.
+ * Carved chunks moved out of the arena tree are flagged as escaped and keep
+ * the blocks alive until they are freed. Non-carved chunks moved below a
+ * carved chunk are flagged as foreign, and force nfree() of the root to walk
+ * the tree so that they are released.
+ */
+
+struct block {
+	struct block *next;
+	struct arena *arena;
+	unsigned shift;       /* log2 of the size of the block. */
+};
+
+struct arena {
+	struct block *blocks; /* Current block first. */
+	char *top, *end;      /* Free space in the current block. */
+	unsigned shift;       /* log2 of the size of new blocks. */
+	unsigned top_shift;   /* log2 of the size of the current block. */
+	size_t escaped;       /* Carved chunks outside the arena tree. */
+	size_t foreign;       /* Non-carved subtrees inside the arena tree. */
+	size_t destructors;   /* Carved chunks with a destructor. */
+	size_t bytes, limit;  /* Size of the blocks, and its limit or 0. */
+	struct arena *outer;  /* Arena the tree is nested in, or NULL. */
+	void *root;           /* Chunk owning the arena, or NULL. */
+	void (*pressure)(void *root, size_t used, size_t size);
+	int node;             /* Preferred NUMA node of the blocks, or -1. */
+	unsigned backend;     /* Allocator of the blocks. */
+	bool huge;            /* Blocks are mapped on huge pages. */
+	bool dead;            /* The arena root has been freed. */
+};
+
+#define ARENA_GRAIN (sizeof(void *) * 2)
+#define ARENA_MIN_SHIFT 12
+#define ARENA_DEFAULT_SHIFT 16
+#define BLOCK_HEADER ALIGN_UP(sizeof(struct block), ARENA_GRAIN)
+#define ARENA_HEADER ALIGN_UP(sizeof(struct arena), ARENA_GRAIN)
+
+static inline struct arena *arena_of(const void *mem)
+{
+	uintptr_t mask = ((uintptr_t)1 << aux(mem)) - 1;
+
+	return ((struct block *)((uintptr_t)usr2raw(mem) & ~mask))->arena;
+}
+
+/**
+ * NUMA placement.
+ *
+ * Blocks are bound to their preferred node with mbind(2), which moves the
+ * pages already touched and falls back to other nodes when that one is full.
+ * Blocks are at least a page large and aligned to their size, so they never
+ * share a page with other memory. The policy outlives the block when it is
+ * given back to an allocator rather than unmapped, so it is reset to the
+ * default one first, for the next user of the pages. Without NUMA support,
+ * placement is a no-op.
+ */
+
+#define MAX_NODES 1024
+#define NUMA_DEFAULT 0
+#define NUMA_PREFERRED 1
+#define NUMA_MOVE 2
+
+/* The node the calling thread runs on, or -1. */
+static int numa_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, node;
+
+	if (!syscall(SYS_getcpu, &cpu, &node, NULL) && node < MAX_NODES)
+		return node;
+#endif
+	return -1;
+}
+
+/* Prefer a node for some memory, false if the node does not exist. */
+static bool numa_bind(void *mem, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask[MAX_NODES / (sizeof(long) * 8)] = { 0 };
+
+	mask[node / (sizeof(long) * 8)] = 1ul << node % (sizeof(long) * 8);
+	return !syscall(SYS_mbind, mem, size, NUMA_PREFERRED, mask,
+			sizeof(mask) * 8 + 1, NUMA_MOVE) || errno != EINVAL;
+#else
+	return true;
+#endif
+}
+
+/* Give some memory bound with numa_bind() the default policy back. */
+static void numa_unbind(void *mem, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	syscall(SYS_mbind, mem, size, NUMA_DEFAULT, NULL, 0, 0);
+#else
+	(void)mem;
+	(void)size;
+#endif
+}
+
+/**
+ * Huge page blocks.
+ *
+ * Blocks of huge arenas are mapped directly, aligned to their size, which is
+ * at least that of a huge page. Explicit huge pages are used when some are
+ * reserved (1 GiB ones when the blocks are that large), and transparent huge
+ * pages are requested otherwise. Each block goes away with a single munmap().
+ */
+
+#define HUGE_SHIFT 21
+
+static COLD bool huge_map(char *mem, size_t size, unsigned shift)
+{
+#ifdef MAP_HUGETLB
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB;
+
+#ifdef MAP_HUGE_SHIFT
+	if (shift >= 30 && mmap(mem, size, PROT_READ | PROT_WRITE,
+				flags | 30 << MAP_HUGE_SHIFT, -1, 0) != MAP_FAILED)
+		return true;
+#endif
+	if (mmap(mem, size, PROT_READ | PROT_WRITE, flags, -1, 0) != MAP_FAILED)
+		return true;
+#endif
+	if (mmap(mem, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+		return false;
+#ifdef MADV_HUGEPAGE
+	madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	return true;
+}
+
+static COLD struct block *huge_block(unsigned shift)
+{
+	size_t size = (size_t)1 << shift;
+	char *base, *block;
+
+	/* Reserve twice the size to find an aligned block inside. */
+	if (size > SIZE_MAX / 2 ||
+	    (base = mmap(NULL, size * 2, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			 -1, 0)) == MAP_FAILED)
+		return NULL;
+
+	block = (char *)ALIGN_UP((uintptr_t)base, size);
+	if (block != base)
+		munmap(base, block - base);
+	munmap(block + size, base + size - block);
+
+	if (!huge_map(block, size, shift)) {
+		munmap(block, size);
+		return NULL;
+	}
+
+	return (struct block *)block;
+}
+
+static struct block *block_new(struct arena *arena, unsigned backend,
+			       unsigned shift, bool huge)
+{
+	struct block *block;
+
+	if (huge)
+		block = huge_block(shift);
+	else
+		block = backend_memalign(backend, (size_t)1 << shift,
+					 (size_t)1 << shift);
+	if (!block)
+		return NULL;
+
+	if (arena && arena->node >= 0)
+		numa_bind(block, (size_t)1 << shift, arena->node);
+
+	block->arena = arena;
+	block->shift = shift;
+	return block;
+}
+
+/**
+ * Create an arena, whose descriptor sits at the start of its first block.
+ */
+static struct arena *arena_new(unsigned shift, unsigned backend, bool huge)
+{
+	struct block *block;
+	struct arena *arena;
+
+	if (!(block = block_new(NULL, backend, shift, huge)))
+		return NULL;
+
+	arena = (struct arena *)((char *)block + BLOCK_HEADER);
+	memset(arena, 0, sizeof(*arena));
+	block->next = NULL;
+	block->arena = arena;
+	arena->backend = backend;
+	arena->node = -1;
+	arena->huge = huge;
+
+	arena->blocks = block;
+	arena->bytes = (size_t)1 << shift;
+	arena->shift = arena->top_shift = shift;
+	arena->top = (char *)arena + ARENA_HEADER;
+	arena->end = (char *)block + ((size_t)1 << shift);
+
+	return arena;
+}
+
+/* Whether size more bytes fit in the limit of an arena. */
+static inline bool arena_fits(const struct arena *arena, size_t size)
+{
+	return !arena->limit || (arena->bytes <= arena->limit &&
+				 size <= arena->limit - arena->bytes);
+}
+
+/**
+ * Check that size more bytes fit in the limit of an arena and of the ones
+ * it is nested in, giving the pressure callback of each a chance to make
+ * room if they do not.
+ */
+static bool arena_budget(struct arena *arena, size_t size)
+{
+	for (; arena; arena = arena->outer) {
+		if (likely(arena_fits(arena, size)))
+			continue;
+
+		if (arena->pressure)
+			arena->pressure(arena->root, arena->bytes, size);
+
+		if (!arena_fits(arena, size))
+			return false;
+	}
+
+	return true;
+}
+
+/* Count size more bytes towards an arena and the ones it is nested in. */
+static void arena_charge(struct arena *arena, size_t size)
+{
+	for (; arena; arena = arena->outer)
+		arena->bytes += size;
+}
+
+static void arena_credit(struct arena *arena, size_t size)
+{
+	for (; arena; arena = arena->outer)
+		arena->bytes -= size;
+}
+
+/**
+ * Carve a raw chunk out of a new arena block.
+ *
+ * Requests larger than half a block get a dedicated block, linked behind
+ * the current one so that its free space is not lost. Close to the limit of
+ * the arena, smaller blocks are used as long as the request fits.
+ */
+static COLD void *arena_grow(struct arena *arena, size_t size, unsigned *shift)
+{
+	struct block *block;
+
+	if (size > (((size_t)1 << arena->shift) - BLOCK_HEADER) / 2) {
+		for (*shift = arena->shift;
+		     ((size_t)1 << *shift) - BLOCK_HEADER < size; ++*shift)
+			if (*shift == sizeof(size_t) * 8 - 2)
+				return NULL;
+
+		if (!arena_budget(arena, (size_t)1 << *shift) ||
+		    !(block = block_new(arena, arena->backend, *shift,
+						 arena->huge)))
+			return NULL;
+
+		arena_charge(arena, (size_t)1 << *shift);
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+		return (char *)block + BLOCK_HEADER;
+	}
+
+	*shift = arena->shift;
+	while (*shift > (arena->huge ? HUGE_SHIFT : ARENA_MIN_SHIFT) &&
+	       !arena_fits(arena, (size_t)1 << *shift) &&
+	       ((size_t)1 << (*shift - 1)) - BLOCK_HEADER >= size)
+		--*shift;
+
+	if (!arena_budget(arena, (size_t)1 << *shift) ||
+	    !(block = block_new(arena, arena->backend, *shift,
+						 arena->huge)))
+		return NULL;
+
+	arena_charge(arena, (size_t)1 << *shift);
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->top = (char *)block + BLOCK_HEADER + size;
+	arena->end = (char *)block + ((size_t)1 << *shift);
+	arena->top_shift = *shift;
+
+	return (char *)block + BLOCK_HEADER;
+}
+
+/**
+ * Place the blocks of a new arena on a NUMA node, or nowhere in particular
+ * if it is negative.
+ */
+static bool arena_place(struct arena *arena, int node)
+{
+	arena->node = node;
+	return node < 0 ||
+	       numa_bind(arena->blocks, (size_t)1 << arena->top_shift, node);
+}
+
+/* The NUMA node of an arena living below a chunk, or -1. */
+static inline int parent_node(const void *parent)
+{
+	return parent && is_carved(parent) ? arena_of(parent)->node : -1;
+}
+
+static inline void *arena_carve(struct arena *arena, size_t size,
+				unsigned *shift)
+{
+	void *mem = arena->top;
+
+	size = ALIGN_UP(size, ARENA_GRAIN);
+
+	if (unlikely(size > (size_t)(arena->end - arena->top)))
+		return arena_grow(arena, size, shift);
+
+	arena->top += size;
+	*shift = arena->top_shift;
+	return mem;
+}
+
+static void *arena_alloc(size_t size, void *parent)
+{
+	unsigned shift;
+	void *mem = arena_carve(arena_of(parent), size + HEADER_SIZE, &shift);
+
+	if (unlikely(!(mem = nalloc_init(mem, size, shift, parent))))
+		return NULL;
+
+	meta(mem) |= CHUNK_ARENA;
+	return mem;
+}
+
+static COLD void arena_destroy(struct arena *arena)
+{
+	struct block *block = arena->blocks, *next;
+	unsigned backend = arena->backend;
+	bool huge = arena->huge, bound = arena->node >= 0;
+
+	/* The descriptor goes away with the first block. */
+	for (; block; block = next) {
+		next = block->next;
+		if (huge)
+			munmap(block, (size_t)1 << block->shift);
+		else {
+			if (bound)
+				numa_unbind(block, (size_t)1 << block->shift);
+			backend_free(backend, block);
+		}
+	}
+}
+
+/**
+ * Release a carved chunk. Its memory is only given back with the arena,
+ * unless it was the last one carved.
+ */
+static void arena_free(void *mem)
+{
+	struct arena *arena = arena_of(mem);
+	char *raw = usr2raw(mem);
+
+	/* Give the space back if this is the last chunk carved. */
+	if (raw + ALIGN_UP(chunk_size(mem) + HEADER_SIZE, ARENA_GRAIN) ==
+	    arena->top && !(meta(mem) & CHUNK_ARENA_ROOT))
+		arena->top = raw;
+
+	if (meta(mem) & CHUNK_ESCAPED)
+		arena->escaped--;
+
+	if (meta(mem) & CHUNK_ARENA_ROOT) {
+		/* Parallel frees do not unnest the trees they meet. */
+		arena_credit(arena->outer, arena->bytes);
+		arena->outer = NULL;
+		arena->dead = true;
+	}
+
+	if (arena->dead && !arena->escaped)
+		arena_destroy(arena);
+}
+
+static void *arena_realloc(void *usr, size_t size)
+{
+	struct arena *arena = arena_of(usr);
+	size_t used = ALIGN_UP(chunk_size(usr) + HEADER_SIZE, ARENA_GRAIN);
+	char *end = (char *)usr2raw(usr) + used;
+	unsigned shift;
+	void *mem;
+
+	/* Shrink in place, or grow if this is the last chunk carved. */
+	if (size + HEADER_SIZE <= used ||
+	    (end == arena->top &&
+	     size + HEADER_SIZE <= used + (size_t)(arena->end - end))) {
+		if (end == arena->top)
+			arena->top = (char *)usr2raw(usr) +
+				     ALIGN_UP(size + HEADER_SIZE, ARENA_GRAIN);
+		set_size(usr, size);
+		return usr;
+	}
+
+	if (!(mem = arena_carve(arena, size + HEADER_SIZE, &shift)))
+		return NULL;
+
+	memcpy(mem, usr2raw(usr), HEADER_SIZE + chunk_size(usr));
+	mem = raw2usr(mem);
+	set_size(mem, size);
+	set_aux(mem, shift);
+	relink(mem, usr);
+
+	if (arena->root == usr)
+		arena->root = mem;
+
+	return mem;
+}
+
+static void nest(void *mem, struct arena *arena);
+static void unnest(void *mem, struct arena *arena);
+
+/**
+ * Reparent a chunk that is carved or is moving in or out of an arena tree,
+ * keeping the escaped and foreign counts of the arenas involved.
+ */
+static COLD void arena_set_parent(void *mem, void *parent, bool append)
+{
+	bool inside = parent && is_carved(parent) && is_carved(mem) &&
+		      !(meta(mem) & CHUNK_ARENA_ROOT) &&
+		      arena_of(parent) == arena_of(mem);
+	struct arena *outer;
+
+	if (meta(mem) & CHUNK_FOREIGN) {
+		outer = arena_of(nalloc_get_parent(mem));
+		outer->foreign--;
+		unnest(mem, outer);
+		meta(mem) &= ~CHUNK_FOREIGN;
+	}
+
+	__set_parent(mem, parent, append);
+
+	if (is_carved(mem) && !(meta(mem) & CHUNK_ARENA_ROOT) &&
+	    inside == !!(meta(mem) & CHUNK_ESCAPED)) {
+		meta(mem) ^= CHUNK_ESCAPED;
+
+		if (inside)
+			arena_of(mem)->escaped--;
+		else
+			arena_of(mem)->escaped++;
+	}
+
+	if (parent && is_carved(parent) && !inside) {
+		meta(mem) |= CHUNK_FOREIGN;
+		arena_of(parent)->foreign++;
+		nest(mem, arena_of(parent));
+	}
+}
+
+/**
+ * Compact arenas.
+ *
+ * A compact arena is a region of 4 GiB of address space, aligned to its
+ * size and committed as it fills up, out of which chunks are carved with a
+ * bump pointer. All the chunks of a region share the upper half of their
+ * address, so their links only keep the lower half, and their header shrinks
+ * to four 32-bit words:
+ *
+ * +-------+---------+---------+------+--------···
+ * | first |  next   |  prev   | meta | memory
+ * | child | sibling | sibling |      | chunk
+ * +-------+---------+---------+------+--------···
+ *
+ * The meta field keeps the chunk flags where the regular header has them,
+ * so that they can be tested before knowing the layout, and the size in its
+ * low 20 bits. The region starts with its descriptor, so that offset 0 can
+ * stand for NULL.
+ *
+ * The region is owned by a regular chunk, the compact root, carved out of
+ * the region itself so that compact chunks can link back to it. It takes
+ * part in the hierarchy as any other chunk, but its descendants are compact
+ * chunks, that are released all at once with the region. Compact chunks can
+ * not link to chunks outside of their region: they can not be moved out of
+ * it and regular chunks can not be moved in. A compact chunk detached from
+ * its parent stays in the region, and goes away with it.
+ */
+
+struct compact {
+	char *top, *end;     /* Free committed space in the region. */
+	struct arena *outer; /* Arena the region is nested in, or NULL. */
+};
+
+#define COMPACT_SPAN ((uint64_t)UINT32_MAX + 1)
+#define COMPACT_COMMIT ((size_t)1 << 20)
+
+/**
+ * Reserve a region of address space aligned to its size.
+ *
+ * @return the start of the region, or NULL if there was an error.
+ */
+static COLD char *compact_reserve(void)
+{
+	char *base, *region;
+
+	/* Reserve twice the span to find an aligned region inside. */
+	base = mmap(NULL, COMPACT_SPAN * 2, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	region = (char *)ALIGN_UP((uintptr_t)base, COMPACT_SPAN);
+	if (region != base)
+		munmap(base, region - base);
+	munmap(region + COMPACT_SPAN, base + COMPACT_SPAN - region);
+
+	return region;
+}
+
+static COLD bool compact_commit(struct compact *region, char *top)
+{
+	char *end = (char *)ALIGN_UP((uintptr_t)top, COMPACT_COMMIT);
+
+	if ((uint64_t)(end - (char *)region) > COMPACT_SPAN ||
+	    (region->outer && !arena_budget(region->outer, end - region->end)) ||
+	    mprotect(region->end, end - region->end, PROT_READ | PROT_WRITE))
+		return false;
+
+	arena_charge(region->outer, end - region->end);
+	region->end = end;
+	return true;
+}
+
+static inline void *compact_carve(struct compact *region, size_t size)
+{
+	char *mem = region->top;
+
+	size = ALIGN_UP(size, ARENA_GRAIN);
+
+	if (unlikely(size > (size_t)(region->end - mem)) &&
+	    !compact_commit(region, mem + size))
+		return NULL;
+
+	region->top += size;
+	return mem;
+}
+
+/* Offset of the first child of a compact chunk or compact root. */
+static inline uint32_t compact_first(const void *mem)
+{
+	return meta(mem) & CHUNK_COMPACT ? compact_child(mem) :
+					   compact_off(child(mem));
+}
+
+static inline void compact_set_first(void *mem, uint32_t first)
+{
+	if (meta(mem) & CHUNK_COMPACT)
+		compact_child(mem) = first;
+	else
+		child(mem) = first ? compact_ptr(mem, first) : NULL;
+}
+
+/**
+ * Whether a memory chunk can depend on parent: compact chunks only link to
+ * the compact chunks and root of their region, and regular chunks only to
+ * regular chunks.
+ */
+static inline bool links_fit(const void *mem, const void *parent)
+{
+	if (!parent)
+		return true;
+
+	if (!(meta(mem) & CHUNK_COMPACT))
+		return !in_compact(parent);
+
+	return in_compact(parent) && compact_base(parent) == compact_base(mem);
+}
+
+/**
+ * The compact header counterpart of __set_parent().
+ */
+static void compact_set_parent(void *mem, void *parent, bool append)
+{
+	uint32_t prev = compact_prev(mem), next = compact_next(mem), first;
+
+	if (prev) {
+		/* Remove node from old tree. */
+		if (prev == compact_off(mem))
+			compact_set_first(compact_ptr(mem, next), 0);
+		else {
+			void *p = compact_ptr(mem, prev);
+
+			if (compact_next(p) & LAST_TAG)
+				compact_set_first(compact_ptr(mem, compact_next(p)),
+						  next);
+			else
+				compact_next(p) = next;
+
+			if (next & LAST_TAG)
+				compact_prev(compact_ptr(mem, compact_first(
+					compact_ptr(mem, next)))) = prev;
+			else
+				compact_prev(compact_ptr(mem, next)) = prev;
+		}
+	}
+
+	compact_next(mem) = compact_prev(mem) = 0;
+
+	if (!parent)
+		return;
+
+	/* Insert node into new tree. */
+	if (!(first = compact_first(parent))) {
+		compact_next(mem) = compact_off(parent) | LAST_TAG;
+		compact_prev(mem) = compact_off(mem);
+		compact_set_first(parent, compact_off(mem));
+	} else if (!append) {
+		compact_next(mem) = first;
+		compact_prev(mem) = compact_prev(compact_ptr(mem, first));
+		compact_prev(compact_ptr(mem, first)) = compact_off(mem);
+		compact_set_first(parent, compact_off(mem));
+	} else {
+		compact_next(mem) = compact_off(parent) | LAST_TAG;
+		compact_prev(mem) = compact_prev(compact_ptr(mem, first));
+		compact_next(compact_ptr(mem, compact_prev(mem))) =
+			compact_off(mem);
+		compact_prev(compact_ptr(mem, first)) = compact_off(mem);
+	}
+}
+
+/**
+ * The compact header counterpart of relink().
+ */
+static void compact_relink(void *mem, const void *usr)
+{
+	uint32_t off = compact_off(mem), first = compact_child(mem);
+	void *prev;
+
+	if (first)
+		compact_next(compact_ptr(mem, compact_prev(compact_ptr(mem, first))))
+			= off | LAST_TAG;
+
+	if (!compact_prev(mem))
+		return;
+
+	if (compact_prev(mem) == compact_off(usr)) {
+		compact_prev(mem) = off;
+		compact_set_first(compact_ptr(mem, compact_next(mem)), off);
+		return;
+	}
+
+	if (compact_next(mem) & LAST_TAG)
+		compact_prev(compact_ptr(mem, compact_first(
+			compact_ptr(mem, compact_next(mem))))) = off;
+	else
+		compact_prev(compact_ptr(mem, compact_next(mem))) = off;
+
+	prev = compact_ptr(mem, compact_prev(mem));
+	if (compact_next(prev) & LAST_TAG)
+		compact_set_first(compact_ptr(mem, compact_next(prev)), off);
+	else
+		compact_next(prev) = off;
+}
+
+static void *compact_alloc(size_t size, void *parent)
+{
+	void *mem;
+
+	if (unlikely(size > COMPACT_MAX_SIZE) ||
+	    !(mem = compact_carve((struct compact *)compact_base(parent),
+				  size + COMPACT_HEADER)))
+		return NULL;
+
+	memset(mem, 0, COMPACT_HEADER);
+	mem = (char *)mem + COMPACT_HEADER;
+	meta(mem) = CHUNK_COMPACT | (uint32_t)size;
+
+	compact_set_parent(mem, parent, appends(parent));
+	return mem;
+}
+
+/**
+ * Resize a compact chunk or compact root. Their memory is only given back
+ * with the region.
+ */
+static void *compact_realloc(void *usr, size_t size)
+{
+	struct compact *region = (struct compact *)compact_base(usr);
+	bool root = meta(usr) & CHUNK_COMPACT_ROOT;
+	size_t header = root ? HEADER_SIZE : COMPACT_HEADER;
+	size_t old = root ? chunk_size(usr) : compact_size(usr);
+	char *raw = (char *)usr - header;
+	char *end = raw + ALIGN_UP(header + old, ARENA_GRAIN);
+	void *mem = raw;
+
+	if (!root && unlikely(size > COMPACT_MAX_SIZE))
+		return NULL;
+
+	/* Shrink in place, or move the top if this is the last chunk carved. */
+	if (end == region->top) {
+		region->top = raw;
+		if (!compact_carve(region, header + size)) {
+			region->top = end;
+			return NULL;
+		}
+	} else if (header + size > (size_t)(end - raw)) {
+		if (!(mem = compact_carve(region, header + size)))
+			return NULL;
+		memcpy(mem, raw, header + old);
+	}
+
+	mem = (char *)mem + header;
+
+	if (root)
+		set_size(mem, size);
+	else
+		meta(mem) = (meta(mem) & ~COMPACT_MAX_SIZE) | (uint32_t)size;
+
+	if (mem != usr) {
+		if (root)
+			relink(mem, usr);
+		else
+			compact_relink(mem, usr);
+	}
+
+	return mem;
+}
+
+static void *compact_get_parent(const void *mem)
+{
+	if (!compact_prev(mem))
+		return NULL;
+
+	/* The last sibling is next to the first one. */
+	if (compact_next(compact_ptr(mem, compact_prev(mem))) & LAST_TAG)
+		mem = compact_ptr(mem, compact_prev(mem));
+
+	while (!(compact_next(mem) & LAST_TAG))
+		mem = compact_ptr(mem, compact_next(mem));
+
+	return compact_ptr(mem, compact_next(mem));
+}
+
+/**
+ * Move the compact children of a detached chunk to parent, in O(1) unless
+ * they are detached.
+ */
+static void compact_cut(void *mem, void *parent)
+{
+	uint32_t first = compact_first(mem), last, head;
+
+	if (!first)
+		return;
+
+	if (unlikely(!links_fit(compact_ptr(mem, first), parent))) {
+		/* Fail if the children can not link to their new parent. */
+		assert(false);
+		return;
+	}
+
+	if (!parent) {
+		while ((first = compact_first(mem)))
+			compact_set_parent(compact_ptr(mem, compact_prev(
+				compact_ptr(mem, first))), NULL, false);
+		return;
+	}
+
+	/* Insert mem children in front of the list of parent children. */
+	last = compact_prev(compact_ptr(mem, first));
+
+	if ((head = compact_first(parent))) {
+		compact_prev(compact_ptr(mem, first)) =
+			compact_prev(compact_ptr(mem, head));
+		compact_next(compact_ptr(mem, last)) = head;
+		compact_prev(compact_ptr(mem, head)) = last;
+	} else
+		compact_next(compact_ptr(mem, last)) =
+			compact_off(parent) | LAST_TAG;
+
+	compact_set_first(parent, first);
+	compact_set_first(mem, 0);
+}
+
+static COLD void compact_destroy(void *mem)
+{
+	struct compact *region = (struct compact *)compact_base(mem);
+
+	if (!(meta(mem) & CHUNK_SNAPSHOT))
+		arena_credit(region->outer, region->end - (char *)region);
+	munmap(region, COMPACT_SPAN);
+}
+
+/**
+ * Get the parent of a chunk, without counting the lookup.
+ *
+ * @param mem    pointer to allocated memory chunk.
+ * @param steps  incremented with the number of siblings walked over.
+ *
+ * @return pointer to the parent memory chunk (could be NULL).
+ */
+static inline void *get_parent(const void *mem, size_t *steps)
+{
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return compact_get_parent(mem);
+
+	if (is_root(mem))
+		return NULL;
+
+#ifdef NALLOC_PARENT
+	(void)steps;
+	return parent(mem);
+#else
+	/* The last sibling is next to the first one. */
+	if (is_first(mem))
+		mem = prev(mem);
+
+	for (; !is_last(mem); (*steps)++)
+		mem = next(mem);
+
+	return untag(next(mem));
+#endif
+}
+
+#if NALLOC_HARDEN >= 2
+/* Whether a chunk is parent or one of its ancestors. */
+static bool is_ancestor(const void *mem, const void *parent)
+{
+	size_t steps = 0;
+
+	for (const void *node = parent; node; node = get_parent(node, &steps))
+		if (unlikely(node == mem))
+			return true;
+
+	return false;
+}
+#endif
+
+static inline void set_parent(void *mem, void *parent, bool append)
+{
+	if (unlikely(!mem))
+		return;
+
+	check_chunk(mem);
+	if (parent)
+		check_chunk(parent);
+
+#if NALLOC_HARDEN >= 2
+	if (unlikely(is_ancestor(mem, parent))) {
+		/* Refuse to make the chunk its own descendant. */
+		assert(false);
+		return;
+	}
+#endif
+
+	if (likely(!(meta(mem) & (CHUNK_ARENA | CHUNK_FOREIGN | CHUNK_COMPACT)) &&
+		   (!parent || !(meta(parent) & (CHUNK_ARENA | CHUNK_COMPACT |
+						 CHUNK_COMPACT_ROOT))))) {
+		__set_parent(mem, parent, append);
+		return;
+	}
+
+	if (unlikely(!links_fit(mem, parent) ||
+		     ((meta(mem) | (parent ? meta(parent) : 0)) &
+		      CHUNK_SNAPSHOT))) {
+		/* Fail if the chunk can not link to its new parent. */
+		assert(false);
+		return;
+	}
+
+	if (meta(mem) & CHUNK_COMPACT)
+		compact_set_parent(mem, parent, append);
+	else
+		arena_set_parent(mem, parent, append);
+}
+
+/**
+ * Whether a range of siblings starting at a chunk can move below parent
+ * without changing the arena flags of any of them, which is the case when
+ * both parents are regular chunks, or are carved from the same arena. The
+ * old parent is told by the flags of the first chunk.
+ */
+static inline bool range_fits(const void *first, const void *parent)
+{
+	if ((meta(first) & (CHUNK_FOREIGN | CHUNK_COMPACT)) || is_root(first) ||
+	    in_compact(parent))
+		return false;
+
+	if (is_carved(first) &&
+	    !(meta(first) & (CHUNK_ARENA_ROOT | CHUNK_ESCAPED)))
+		return is_carved(parent) && arena_of(parent) == arena_of(first);
+
+	return !is_carved(parent);
+}
+
+/**
+ * Move a range of siblings after the last child of parent, relinking only
+ * the ends of the range (and, with NALLOC_PARENT, its parent links).
+ */
+static void move_range(void *first, void *last, void *parent)
+{
+	void *before = prev(first), *after = next(last), *head;
+
+	if (is_first(first)) {
+		/* The last sibling links back to the old parent. */
+		if (is_last(last))
+			child(untag(after)) = NULL;
+		else {
+			child(untag(next(before))) = after;
+			prev(after) = before;
+		}
+	} else {
+		next(before) = after;
+		if (is_last(last))
+			prev(child(untag(after))) = before;
+		else
+			prev(after) = before;
+	}
+
+	if ((head = child(parent))) {
+		prev(first) = prev(head);
+		next(prev(head)) = first;
+		prev(head) = last;
+	} else {
+		prev(first) = last;
+		child(parent) = first;
+	}
+	next(last) = tag(parent);
+
+#ifdef NALLOC_PARENT
+	for (void *node = first;; node = next(node)) {
+		parent(node) = parent;
+		if (node == last)
+			break;
+	}
+#endif
+}
+
+/**
+ * Aligned chunks.
+ *
+ * The user memory of every chunk is aligned to NATURAL_ALIGN. Chunks with
+ * a larger alignment are requested from the system allocator with enough
+ * padding in front of their header, and bypass the cache and arenas. They
+ * keep log2 of their alignment in the low bits of the aux field, from which
+ * the padding is found again, and the id of their allocator above it.
+ */
+
+#define HEADER_ALIGN ((size_t)HEADER_SIZE & -(size_t)HEADER_SIZE)
+#define NATURAL_ALIGN (HEADER_ALIGN < ARENA_GRAIN ? HEADER_ALIGN : ARENA_GRAIN)
+
+#define aligned_pad(align) (ALIGN_UP(HEADER_SIZE, align) - HEADER_SIZE)
+#define aligned_shift(mem) (aux(mem) & ((1u << BACKEND_SHIFT) - 1))
+#define aligned_backend(mem) (aux(mem) >> BACKEND_SHIFT)
+
+/* The allocator of a chunk, that its children get theirs from. */
+static inline unsigned backend_of(const void *mem)
+{
+	if (is_carved(mem))
+		return arena_of(mem)->backend;
+
+	if (likely(!(meta(mem) & CHUNK_CUSTOM)))
+		return 0;
+
+	return meta(mem) & CHUNK_ALIGNED ? aligned_backend(mem) : aux(mem);
+}
+
+static void *aligned_alloc_raw(size_t size, size_t align, unsigned backend)
+{
+	void *mem;
+
+	if (size > MAX_SIZE - aligned_pad(align) - HEADER_SIZE ||
+	    !(mem = backend_memalign(backend, align,
+				     aligned_pad(align) + HEADER_SIZE + size)))
+		return NULL;
+
+	return (char *)mem + aligned_pad(align);
+}
+
+static void *aligned_alloc_chunk(size_t size, size_t align, void *parent)
+{
+	unsigned shift = 0, backend;
+	void *mem;
+
+	if (parent && unlikely(in_compact(parent)))
+		return NULL;
+
+	while (((size_t)1 << shift) < align)
+		shift++;
+
+	backend = parent ? backend_of(parent) : default_backend();
+	if (parent && is_carved(parent) &&
+	    (size > MAX_SIZE - aligned_pad(align) - HEADER_SIZE ||
+	     !arena_budget(arena_of(parent),
+			   aligned_pad(align) + HEADER_SIZE + size)))
+		return NULL;
+
+	mem = aligned_alloc_raw(size, align, backend);
+	if (!(mem = nalloc_init(mem, size, shift | backend << BACKEND_SHIFT,
+				NULL)))
+		return NULL;
+
+	meta(mem) |= CHUNK_ALIGNED | (backend ? CHUNK_CUSTOM : 0);
+
+	set_parent(mem, parent, appends(parent));
+	return mem;
+}
+
+/**
+ * Resize an aligned chunk. It moves to a new block unless it shrinks by
+ * less than half, since realloc() does not keep the alignment. The change
+ * counts towards the arena tree it is nested in, if any.
+ */
+static void *aligned_realloc(void *usr, size_t size)
+{
+	size_t align = (size_t)1 << aligned_shift(usr), old = chunk_size(usr);
+	struct arena *outer = NULL;
+	void *mem;
+
+	if (meta(usr) & CHUNK_FOREIGN)
+		outer = arena_of(nalloc_get_parent(usr));
+
+	if (size <= old && size >= old / 2) {
+		arena_credit(outer, old - size);
+		set_size(usr, size);
+		return usr;
+	}
+
+	if ((size > old && outer && !arena_budget(outer, size - old)) ||
+	    !(mem = aligned_alloc_raw(size, align, aligned_backend(usr))))
+		return NULL;
+
+	if (size > old)
+		arena_charge(outer, size - old);
+	else
+		arena_credit(outer, old - size);
+
+	memcpy(mem, usr2raw(usr), HEADER_SIZE + (size < old ? size : old));
+	mem = raw2usr(mem);
+	set_size(mem, size);
+	relink(mem, usr);
+
+	backend_free(aligned_backend(mem),
+		     (char *)usr2raw(usr) - aligned_pad(align));
+	return mem;
+}
+
+/**
+ * Nested trees.
+ *
+ * The blocks of an arena tree, the committed space of a compact region and
+ * the memory of an aligned chunk count towards the arena of the chunk they
+ * depend on, when it is carved, as long as they are in its tree. An arena
+ * tree or region keeps a link to that arena, so that it counts the blocks
+ * or space it gets later as well, up through the arenas that one is nested
+ * in, without walking the trees. Other chunks depending on a carved chunk
+ * without being carved from its arena are not counted.
+ */
+
+/* The bytes a chunk moving in or out of an arena tree counts for. */
+static size_t nested_bytes(const void *mem)
+{
+	struct compact *region;
+
+	if (meta(mem) & CHUNK_ARENA_ROOT)
+		return arena_of(mem)->bytes;
+
+	if (meta(mem) & CHUNK_COMPACT_ROOT) {
+		region = (struct compact *)compact_base(mem);
+		return region->end - (char *)region;
+	}
+
+	if (meta(mem) & CHUNK_ALIGNED)
+		return aligned_pad((size_t)1 << aligned_shift(mem)) +
+		       HEADER_SIZE + chunk_size(mem);
+
+	return 0;
+}
+
+/* Count a chunk moved below a carved chunk towards the arena of the latter. */
+static void nest(void *mem, struct arena *arena)
+{
+	arena_charge(arena, nested_bytes(mem));
+
+	if (meta(mem) & CHUNK_ARENA_ROOT)
+		arena_of(mem)->outer = arena;
+	else if (meta(mem) & CHUNK_COMPACT_ROOT)
+		((struct compact *)compact_base(mem))->outer = arena;
+}
+
+static void unnest(void *mem, struct arena *arena)
+{
+	arena_credit(arena, nested_bytes(mem));
+
+	if (meta(mem) & CHUNK_ARENA_ROOT)
+		arena_of(mem)->outer = NULL;
+	else if (meta(mem) & CHUNK_COMPACT_ROOT)
+		((struct compact *)compact_base(mem))->outer = NULL;
+}
+
+/* Whether size bytes created below parent fit in the limits they count for. */
+static inline bool nested_fits(const void *parent, size_t size)
+{
+	return !parent || !is_carved(parent) ||
+	       arena_budget(arena_of(parent), size);
+}
+
+/*
+ * Read-only tree navigation, for either header layout.
+ */
+
+static inline void *first_child(const void *mem)
+{
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return compact_child(mem) ?
+			compact_ptr(mem, compact_child(mem)) : NULL;
+
+	return child(mem);
+}
+
+/* The next sibling of a chunk, or NULL if it is the last one. */
+static inline void *next_sibling(const void *mem)
+{
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return compact_next(mem) & LAST_TAG ?
+			NULL : compact_ptr(mem, compact_next(mem));
+
+	return sibling(mem);
+}
+
+/* The previous sibling of a chunk, or NULL if it is the first one. */
+static inline void *prev_sibling(const void *mem)
+{
+	void *prev;
+
+	if (unlikely(meta(mem) & CHUNK_COMPACT)) {
+		prev = compact_ptr(mem, compact_prev(mem));
+		return compact_next(prev) & LAST_TAG ? NULL : prev;
+	}
+
+	prev = prev(mem);
+	return is_last(prev) ? NULL : prev;
+}
+
+/* The parent of a last child. */
+static inline void *last_parent(const void *mem)
+{
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return compact_ptr(mem, compact_next(mem));
+
+	return untag(next(mem));
+}
+
+/* The last child of a chunk, or NULL if it has none. */
+static inline void *last_child(const void *mem)
+{
+	void *child = first_child(mem);
+
+	if (!child)
+		return NULL;
+
+	if (unlikely(meta(child) & CHUNK_COMPACT))
+		return compact_ptr(child, compact_prev(child));
+
+	return prev(child);
+}
+
+static inline size_t user_size(const void *mem)
+{
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return compact_size(mem);
+
+	return chunk_size(mem);
+}
+
+/* Start loading the header of a chunk, which may straddle a cache line. */
+static inline void prefetch_header(const void *mem)
+{
+	if (mem) {
+		prefetch((const char *)mem - HEADER_SIZE);
+		prefetch((const char *)mem - 1);
+	}
+}
+
+/* Steps of the pre-order walks of a subtree, see walk_next(). */
+enum step { STEP_DOWN, STEP_OVER, STEP_UP };
+
+/*
+ * Take the step of a pre-order walk of the subtree of root after node, and
+ * set *step to it: down to its first child, over to its next sibling, or up
+ * to its parent through the last sibling link. A chunk the walk came up to
+ * is not gone down from again, nor is one the caller set *step to STEP_UP
+ * for, to skip its children. Walks start at root with STEP_DOWN.
+ *
+ * @return the next chunk, or NULL once back up at root.
+ */
+static inline void *walk_next(const void *node, const void *root,
+			      enum step *step)
+{
+	void *next;
+
+	if (*step != STEP_UP && (next = first_child(node))) {
+		*step = STEP_DOWN;
+		return next;
+	}
+
+	*step = STEP_UP;
+	if (node == root)
+		return NULL;
+
+	if ((next = next_sibling(node))) {
+		*step = STEP_OVER;
+		return next;
+	}
+
+	return last_parent(node);
+}
+
+/**
+ * Snapshots.
+ *
+ * A snapshot is the image of a compact region holding a copy of a subtree,
+ * whose chunks all have a compact header and are flagged as part of a
+ * snapshot. Their links are offsets from the start of the image, so once
+ * it is mapped at the start of a region aligned to 4 GiB, like compact
+ * regions are, the read-only navigation works on it as is. The image starts
+ * with its descriptor, so that offset 0 still stands for NULL.
+ *
+ * The copy is written in pre-order by a walk of the subtree that mirrors
+ * each step on the copy: going down to a first child or over to the next
+ * sibling links the new copy to its neighbours, and going back up follows
+ * the tagged next link of the last copy.
+ */
+
+#define SNAPSHOT_MAGIC 0x6e616c6c6f637331ull /* "nallocs1" */
+
+struct snapshot {
+	uint64_t magic;
+	uint64_t size; /* Size of the image (in bytes). */
+	uint32_t root; /* Offset of the root chunk. */
+	uint32_t unused;
+};
+
+#define SNAPSHOT_HEADER ALIGN_UP(sizeof(struct snapshot), ARENA_GRAIN)
+
+#define image_chunk(image, off) ((image) + ((off) & ~(uint32_t)LAST_TAG))
+
+/**
+ * Copy a chunk at the top of an image, without its links, or only make
+ * room for it if image is NULL.
+ *
+ * @return the offset of the copy, or 0 if it does not fit in an image.
+ */
+static uint32_t snapshot_put(char *image, uint64_t *top, const void *mem)
+{
+	size_t size = user_size(mem), used;
+	uint64_t off = *top + COMPACT_HEADER;
+	char *copy;
+
+	used = ALIGN_UP(COMPACT_HEADER + size, ARENA_GRAIN);
+	if (size > COMPACT_MAX_SIZE || *top + used > COMPACT_SPAN)
+		return 0;
+
+	*top += used;
+
+	if (image) {
+		copy = image + off;
+		memset(copy - COMPACT_HEADER, 0, used);
+		memcpy(copy, mem, size);
+		meta(copy) = CHUNK_COMPACT | CHUNK_SNAPSHOT | (uint32_t)size;
+	}
+
+	return (uint32_t)off;
+}
+
+/**
+ * Write the image of a subtree, or only measure it if image is NULL.
+ *
+ * @return the size of the image, or 0 if the subtree does not fit in one.
+ */
+static uint64_t snapshot_write(const void *mem, char *image)
+{
+	uint64_t top = SNAPSHOT_HEADER;
+	const void *node = mem;
+	enum step step = STEP_DOWN;
+	uint32_t cur, off, parent;
+
+	if (!(cur = snapshot_put(image, &top, mem)))
+		return 0;
+
+	if (image) {
+		memset(image, 0, SNAPSHOT_HEADER);
+		((struct snapshot *)image)->magic = SNAPSHOT_MAGIC;
+		((struct snapshot *)image)->root = cur;
+	}
+
+	while ((node = walk_next(node, mem, &step))) {
+		if (step == STEP_UP) {
+			if (image)
+				cur = compact_next(image_chunk(image, cur)) &
+				      ~(uint32_t)LAST_TAG;
+			continue;
+		}
+
+		if (!(off = snapshot_put(image, &top, node)))
+			return 0;
+
+		if (image && step == STEP_DOWN) {
+			compact_child(image_chunk(image, cur)) = off;
+			compact_prev(image_chunk(image, off)) = off;
+			compact_next(image_chunk(image, off)) = cur | LAST_TAG;
+		} else if (image) {
+			parent = compact_next(image_chunk(image, cur));
+			compact_next(image_chunk(image, cur)) = off;
+			compact_prev(image_chunk(image, off)) = cur;
+			compact_next(image_chunk(image, off)) = parent;
+			compact_prev(image_chunk(image, compact_child(
+				image_chunk(image, parent)))) = off;
+		}
+
+		cur = off;
+	}
+
+	if (image)
+		((struct snapshot *)image)->size = top;
+
+	return top;
+}
+
+/**
+ * Instrumentation.
+ *
+ * When built with NALLOC_STATS, each thread counts its operations in its
+ * own counters, registered on first use and folded into the totals of the
+ * exited threads when it exits, so that nalloc_counters() can add them all
+ * up. Counters are only written by their thread, with relaxed atomics so
+ * that they can be read at any time. Freed chunks are counted, and handed
+ * to the free hook, by a read-only walk of the subtree before it is freed,
+ * which also covers the arena trees that are released at once.
+ *
+ * Without NALLOC_STATS, the STAT macros expand to nothing.
+ */
+
+#ifdef NALLOC_STATS
+
+enum {
+	STAT_ALLOCS,
+	STAT_FREES,
+	STAT_MOVES,
+	STAT_REPARENTS,
+	STAT_LOOKUPS,
+	STAT_LOOKUP_STEPS,
+	STAT_CUTS,
+	STAT_CUT_STEPS,
+	STAT_ALLOC_BYTES,
+	STAT_FREE_BYTES,
+	STAT_COUNT
+};
+
+struct counters {
+	struct counters *next;
+	_Atomic size_t count[STAT_COUNT];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	pthread_key_t key;
+	struct counters *all, spill;
+	size_t exited[STAT_COUNT];
+	void (*_Atomic on_alloc)(void *mem, size_t size);
+	void (*_Atomic on_free)(void *mem);
+} stats = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+
+static _Thread_local struct counters *stats_self;
+
+static void stats_detach(void *arg)
+{
+	struct counters *c = arg, **p;
+
+	pthread_mutex_lock(&stats.lock);
+	for (p = &stats.all; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+
+	for (unsigned i = 0; i < STAT_COUNT; i++)
+		stats.exited[i] += c->count[i];
+	pthread_mutex_unlock(&stats.lock);
+
+	free(c);
+	stats_self = NULL;
+}
+
+static void stats_key_init(void)
+{
+	pthread_key_create(&stats.key, stats_detach);
+}
+
+static COLD struct counters *stats_attach(void)
+{
+	struct counters *c;
+
+	pthread_once(&stats.once, stats_key_init);
+
+	/* Threads that can not get counters share racy ones. */
+	if (!(c = calloc(1, sizeof(*c))))
+		return &stats.spill;
+
+	pthread_mutex_lock(&stats.lock);
+	c->next = stats.all;
+	stats.all = c;
+	pthread_mutex_unlock(&stats.lock);
+
+	pthread_setspecific(stats.key, c);
+	return stats_self = c;
+}
+
+static inline void stat_add(unsigned stat, size_t n)
+{
+	struct counters *c = stats_self;
+
+	if (unlikely(!c))
+		c = stats_attach();
+
+	atomic_store_explicit(&c->count[stat],
+			      atomic_load_explicit(&c->count[stat],
+						   memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+#define STAT(stat, n) stat_add(STAT_##stat, n)
+
+static inline void *stat_alloc(void *mem, size_t size)
+{
+	void (*hook)(void *, size_t);
+
+	if (unlikely(!mem))
+		return NULL;
+
+	STAT(ALLOCS, 1);
+	STAT(ALLOC_BYTES, size);
+
+	if ((hook = atomic_load_explicit(&stats.on_alloc, memory_order_relaxed)))
+		hook(mem, size);
+
+	return mem;
+}
+
+static inline void stat_realloc(void *mem, void *usr, size_t old,
+				size_t size)
+{
+	void (*alloc_hook)(void *, size_t), (*free_hook)(void *);
+
+	if (unlikely(!mem))
+		return;
+
+	if (mem != usr)
+		STAT(MOVES, 1);
+
+	STAT(FREE_BYTES, old);
+	STAT(ALLOC_BYTES, size);
+
+	/* The old chunk may no longer be accessible. */
+	if ((free_hook = atomic_load_explicit(&stats.on_free,
+					      memory_order_relaxed)))
+		free_hook(usr);
+	if ((alloc_hook = atomic_load_explicit(&stats.on_alloc,
+					       memory_order_relaxed)))
+		alloc_hook(mem, size);
+}
+
+/**
+ * Count the chunks of a subtree that is about to be freed.
+ */
+static void stat_free(void *mem)
+{
+	void (*hook)(void *) = atomic_load_explicit(&stats.on_free,
+						    memory_order_relaxed);
+	enum step step = STEP_DOWN;
+	size_t nodes = 0, bytes = 0;
+
+	for (void *node = mem; node; node = walk_next(node, mem, &step)) {
+		if (step == STEP_UP)
+			continue;
+
+		nodes++;
+		bytes += user_size(node);
+		if (hook)
+			hook(node);
+	}
+
+	STAT(FREES, nodes);
+	STAT(FREE_BYTES, bytes);
+}
+
+#else
+
+#define STAT(stat, n) ((void)(n))
+#define stat_alloc(mem, size) ((void)(size), (mem))
+#define stat_realloc(mem, usr, old, size) ((void)(old), (void)(size))
+#define stat_free(mem) ((void)0)
+
+#endif
+
+/**
+ * Destructors.
+ *
+ * Destructors are kept in a hash table keyed by chunk address, so that
+ * chunks without one do not pay for them: a chunk with a destructor is
+ * flagged, and only flagged chunks look the table up when they are freed or
+ * moved. Since __nfree() releases a chunk once all of its children are
+ * gone, destructors run child first. Arenas count their carved chunks with
+ * a destructor, and are walked when freed as long as there are any.
+ */
+
+struct destructor {
+	struct destructor *next;
+	const void *mem;
+	void (*fn)(void *mem);
+};
+
+#define DESTRUCTORS_MIN 64
+
+static struct {
+	pthread_mutex_t lock;
+	struct destructor **buckets;
+	size_t count, size;
+} destructors = { PTHREAD_MUTEX_INITIALIZER };
+
+static inline struct destructor **destructor_find(const void *mem)
+{
+	size_t hash = (size_t)((uint64_t)(uintptr_t)mem *
+			       0x9e3779b97f4a7c15ull >> 32);
+	struct destructor **d = &destructors.buckets[hash &
+						     (destructors.size - 1)];
+
+	while (*d && (*d)->mem != mem)
+		d = &(*d)->next;
+
+	return d;
+}
+
+static COLD bool destructors_grow(void)
+{
+	size_t size = destructors.size ? destructors.size * 2 : DESTRUCTORS_MIN;
+	struct destructor **old = destructors.buckets, *d, *next;
+	size_t count = destructors.size;
+
+	if (!(destructors.buckets = calloc(size, sizeof(*old)))) {
+		destructors.buckets = old;
+		return false;
+	}
+
+	destructors.size = size;
+
+	for (size_t i = 0; i < count; i++) {
+		for (d = old[i]; d; d = next) {
+			struct destructor **slot = destructor_find(d->mem);
+
+			next = d->next;
+			d->next = NULL;
+			*slot = d;
+		}
+	}
+
+	free(old);
+	return true;
+}
+
+static bool destructor_set(void *mem, void (*fn)(void *mem))
+{
+	struct destructor **d, *old = NULL;
+	bool ok = true;
+
+	pthread_mutex_lock(&destructors.lock);
+	if (meta(mem) & CHUNK_DESTRUCTOR) {
+		d = destructor_find(mem);
+		if (fn)
+			(*d)->fn = fn;
+		else {
+			old = *d;
+			*d = old->next;
+			destructors.count--;
+		}
+	} else if (fn) {
+		if (destructors.count >= destructors.size &&
+		    !destructors_grow() && !destructors.size)
+			ok = false;
+		else if (!(old = malloc(sizeof(*old))))
+			ok = false;
+		else {
+			d = destructor_find(mem);
+			old->next = NULL;
+			old->mem = mem;
+			old->fn = fn;
+			*d = old;
+			destructors.count++;
+			old = NULL;
+		}
+	}
+	pthread_mutex_unlock(&destructors.lock);
+
+	free(old);
+
+	if (!ok || !fn == !(meta(mem) & CHUNK_DESTRUCTOR))
+		return ok;
+
+	meta(mem) ^= CHUNK_DESTRUCTOR;
+	if (is_carved(mem))
+		arena_of(mem)->destructors += fn ? 1 : -1;
+
+	return true;
+}
+
+/**
+ * Update the destructor of a chunk that moved.
+ *
+ * @param mem  new address of the memory chunk.
+ * @param usr  old address of the memory chunk, no longer accessible.
+ */
+static COLD void destructor_move(void *mem, const void *usr)
+{
+	struct destructor **d, *entry;
+
+	pthread_mutex_lock(&destructors.lock);
+	d = destructor_find(usr);
+	entry = *d;
+	*d = entry->next;
+
+	entry->next = NULL;
+	entry->mem = mem;
+	*destructor_find(mem) = entry;
+	pthread_mutex_unlock(&destructors.lock);
+}
+
+/**
+ * Run the destructor of a chunk about to be freed, and forget it.
+ */
+static COLD void destructor_run(void *mem)
+{
+	struct destructor **d, *entry;
+
+	pthread_mutex_lock(&destructors.lock);
+	d = destructor_find(mem);
+	entry = *d;
+	*d = entry->next;
+	destructors.count--;
+	pthread_mutex_unlock(&destructors.lock);
+
+	if (is_carved(mem))
+		arena_of(mem)->destructors--;
+
+	entry->fn(mem);
+	free(entry);
+}
+
+/**
+ * Clones.
+ *
+ * A clone is an arena tree whose chunks are all carved, in pre-order, out
+ * of the first block of its arena, sized to hold them. It is copied by a
+ * walk of the original that mirrors each step on the copy, the same way
+ * snapshots are written, and freed at once like any other arena tree.
+ * The copies of aligned chunks are carved with the same alignment, from
+ * room set aside for their padding.
+ */
+
+/* The alignment of a chunk from nalloc_aligned(), or 0 for the others. */
+static inline size_t clone_align(const void *mem)
+{
+	return meta(mem) & CHUNK_ALIGNED ? (size_t)1 << aligned_shift(mem) : 0;
+}
+
+/* Size of the raw chunks of a subtree once carved, or 0 if too large. */
+static size_t clone_size(const void *mem)
+{
+	enum step step = STEP_DOWN;
+	size_t total = 0, used;
+
+	for (const void *node = mem; node; node = walk_next(node, mem, &step)) {
+		if (step == STEP_UP)
+			continue;
+
+		used = ALIGN_UP(user_size(node) + HEADER_SIZE, ARENA_GRAIN) +
+		       clone_align(node);
+		if (used > MAX_SIZE - total)
+			return 0;
+		total += used;
+	}
+
+	return total;
+}
+
+static void *clone_put(struct arena *arena, const void *mem)
+{
+	size_t size = user_size(mem), align = clone_align(mem);
+	char *raw = arena->top;
+	void *copy;
+
+	if (align)
+		raw = (char *)ALIGN_UP((uintptr_t)raw + HEADER_SIZE, align) -
+		      HEADER_SIZE;
+
+	copy = raw2usr(raw);
+	arena->top = (char *)ALIGN_UP((uintptr_t)copy + size, ARENA_GRAIN);
+	memset(raw, 0, HEADER_SIZE);
+	memcpy(copy, mem, size);
+	set_canary(copy);
+	set_site(copy, get_site(mem));
+	set_size(copy, size);
+	set_aux(copy, arena->top_shift);
+	meta(copy) |= CHUNK_ARENA | (meta(mem) & CHUNK_APPEND);
+
+	return copy;
+}
+
+/* Hand the destructors of a subtree over to the matching chunks of a clone. */
+static COLD void clone_destructors(void *copy, void *mem)
+{
+	void *node = mem, *cur = copy;
+	enum step step = STEP_DOWN;
+
+	while (node) {
+		if (step != STEP_UP && (meta(node) & CHUNK_DESTRUCTOR)) {
+			destructor_move(cur, node);
+			meta(node) &= ~CHUNK_DESTRUCTOR;
+			meta(cur) |= CHUNK_DESTRUCTOR;
+			if (is_carved(node))
+				arena_of(node)->destructors--;
+			arena_of(cur)->destructors++;
+		}
+
+		/* Take the same step on the copy. */
+		if (!(node = walk_next(node, mem, &step)))
+			break;
+		cur = step == STEP_DOWN ? first_child(cur) :
+		      step == STEP_OVER ? next_sibling(cur) : last_parent(cur);
+	}
+}
+
+/**
+ * Copy a subtree below parent, into an arena whose blocks come from the
+ * allocator of like, and are placed on its NUMA node, if any.
+ */
+static void *clone_tree(const void *mem, void *parent, const void *like)
+{
+	size_t total = BLOCK_HEADER + ARENA_HEADER, size = clone_size(mem);
+	const void *node = mem;
+	void *root, *cur, *copy, *last;
+	enum step step = STEP_DOWN;
+	struct arena *arena;
+	unsigned shift = 0;
+
+	if (!size || size > MAX_SIZE - total)
+		return NULL;
+
+	for (total += size; ((size_t)1 << shift) < total; shift++)
+		;
+
+	if (!nested_fits(parent, (size_t)1 << shift) ||
+	    !(arena = arena_new(shift, like ? backend_of(like) :
+					      default_backend(), false)))
+		return NULL;
+
+	arena->shift = ARENA_MIN_SHIFT;
+	arena_place(arena, parent_node(like));
+	root = cur = clone_put(arena, mem);
+	meta(root) |= CHUNK_ARENA_ROOT;
+	arena->root = root;
+
+	while ((node = walk_next(node, mem, &step))) {
+		if (step == STEP_UP) {
+			cur = untag(next(cur));
+			continue;
+		}
+
+		copy = clone_put(arena, node);
+		if (step == STEP_DOWN) {
+			child(cur) = copy;
+			prev(copy) = copy;
+			next(copy) = tag(cur);
+#ifdef NALLOC_PARENT
+			parent(copy) = cur;
+#endif
+		} else {
+			last = next(cur);
+			next(cur) = copy;
+			prev(copy) = cur;
+			next(copy) = last;
+			prev(child(untag(last))) = copy;
+#ifdef NALLOC_PARENT
+			parent(copy) = untag(last);
+#endif
+		}
+		cur = copy;
+	}
+
+	set_parent(root, parent, appends(parent));
+
+#ifdef NALLOC_STATS
+	step = STEP_DOWN;
+	for (cur = root; cur; cur = walk_next(cur, root, &step))
+		if (step != STEP_UP)
+			stat_alloc(cur, chunk_size(cur));
+#endif
+	return root;
+}
+
+/**
+ * Heap profiles.
+ *
+ * nalloc_dump_profile() sums the chunks of a subtree up by stack of
+ * allocation sites, into a tree of frames. A chunk with a site counts
+ * towards the frame of that site below the frame of its parent, which is
+ * pushed as the walk enters the chunk and popped as it leaves it, and a
+ * chunk without one (or with the same one) towards the frame of its parent.
+ * The root frame holds the chunks without any site.
+ *
+ * The frames come from malloc() and have links of their own, so that a
+ * dump neither shows in the statistics nor calls the hooks.
+ */
+
+struct frame {
+	const char *site;
+	struct frame *up, *child, *next;
+	const void *owner; /* Chunk that pushed the frame last. */
+	size_t bytes, count;
+};
+
+/* The walk_next() of frames. */
+static COLD struct frame *frame_next(const struct frame *frame,
+				     const struct frame *root, enum step *step)
+{
+	if (*step != STEP_UP && frame->child) {
+		*step = STEP_DOWN;
+		return frame->child;
+	}
+
+	*step = STEP_UP;
+	if (frame == root)
+		return NULL;
+
+	if (frame->next) {
+		*step = STEP_OVER;
+		return frame->next;
+	}
+
+	return frame->up;
+}
+
+/* Free the frames below root, each one once the walk is done with it. */
+static COLD void frame_free(struct frame *root)
+{
+	struct frame *frame = root, *next;
+	enum step step = STEP_DOWN;
+
+	for (; frame; frame = next) {
+		next = frame_next(frame, root, &step);
+		if (step != STEP_DOWN && frame != root)
+			free(frame);
+	}
+}
+
+static COLD struct frame *frame_enter(struct frame *frame, const void *mem)
+{
+	const char *site = get_site(mem);
+	struct frame *next = frame;
+
+	if (site && (!frame->site || strcmp(site, frame->site))) {
+		for (next = frame->child; next; next = next->next)
+			if (next->site == site || !strcmp(next->site, site))
+				break;
+
+		if (!next) {
+			if (!(next = malloc(sizeof(*next))))
+				return NULL;
+			*next = (struct frame){ .site = site,
+						.up = frame,
+						.next = frame->child };
+			frame->child = next;
+		}
+		next->owner = mem;
+	}
+
+	next->bytes += user_size(mem);
+	next->count++;
+	return next;
+}
+
+/*
+ * Print the frames below root, each one after the sites of the frames from
+ * the top down to it. Frames nest as deep as the chains of alternately
+ * tagged chunks do, so the walk keeps those sites in an array it grows.
+ */
+static COLD int profile_print(const struct frame *root, FILE *fp)
+{
+	const struct frame *frame = root;
+	const char **path = NULL, **grown;
+	size_t depth = 0, room = 0;
+	enum step step = STEP_DOWN;
+	int ret = 0;
+
+	while (frame && ret >= 0) {
+		for (size_t i = 0; frame->count && i < depth && ret >= 0; i++)
+			ret = fprintf(fp, "%s;", path[i]);
+
+		if (frame->count && ret >= 0)
+			ret = fprintf(fp, "%s[%zu chunks] %zu\n",
+				      depth ? "" : "untagged;", frame->count,
+				      frame->bytes);
+
+		if (frame->child && depth == room) {
+			room = room ? room * 2 : 16;
+			if (!(grown = realloc(path, room * sizeof(*path)))) {
+				ret = -1;
+				break;
+			}
+			path = grown;
+		}
+
+		/* Frames are printed on the way down only. */
+		while ((frame = frame_next(frame, root, &step)) &&
+		       step == STEP_UP)
+			depth--;
+
+		if (frame && step == STEP_DOWN)
+			depth++;
+		if (frame)
+			path[depth - 1] = frame->site;
+	}
+
+	free(path);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Poisoning and quarantine of freed chunks, see the hardening tiers above.
+ */
+
+#define POISON 0x6b
+#define QUARANTINE_SLOTS 1024
+
+#if NALLOC_HARDEN >= 3
+static struct {
+	pthread_mutex_t lock;
+	void *slots[QUARANTINE_SLOTS];
+	size_t next;
+} quarantine = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Keep a freed chunk from the system allocator for a while, and give back
+ * the one it replaces once its poison is checked. Cached chunks are reused
+ * right away, so only a quarantine catches late writes to them.
+ */
+static COLD void quarantine_put(void *mem)
+{
+	void *old;
+	size_t size;
+
+	pthread_mutex_lock(&quarantine.lock);
+	old = quarantine.slots[quarantine.next];
+	quarantine.slots[quarantine.next] = mem;
+	quarantine.next = (quarantine.next + 1) % QUARANTINE_SLOTS;
+	pthread_mutex_unlock(&quarantine.lock);
+
+	if (!old)
+		return;
+
+	size = chunk_size(old);
+	for (size_t i = 0; i < size; i++)
+		if (unlikely(((unsigned char *)old)[i] != POISON))
+			harden_fail("use after free", old);
+
+	raw_free(usr2raw(old), size + HEADER_SIZE, aux(old));
+}
+
+/* Release all the quarantined chunks. */
+static COLD void quarantine_flush(void)
+{
+	for (size_t i = 0; i < QUARANTINE_SLOTS; i++)
+		quarantine_put(NULL);
+}
+#endif
+
+static inline void chunk_free(void *mem)
+{
+#if NALLOC_HARDEN
+	canary(mem) = (void *)~canary_key;
+#endif
+#if NALLOC_HARDEN >= 2
+	memset(mem, POISON, chunk_size(mem));
+#endif
+
+	if (likely(!(meta(mem) & (CHUNK_ARENA | CHUNK_COMPACT_ROOT |
+				  CHUNK_ALIGNED | CHUNK_CUSTOM))))
+#if NALLOC_HARDEN >= 3
+		quarantine_put(mem);
+#else
+		raw_free(usr2raw(mem), chunk_size(mem) + HEADER_SIZE, aux(mem));
+#endif
+	else if (is_carved(mem))
+		arena_free(mem);
+	else if (meta(mem) & CHUNK_ALIGNED)
+		backend_free(aligned_backend(mem), (char *)usr2raw(mem) -
+			     aligned_pad((size_t)1 << aligned_shift(mem)));
+	else if (meta(mem) & CHUNK_CUSTOM)
+		backend_free(aux(mem), usr2raw(mem));
+	else
+		compact_destroy(mem);
+}
+
+/**
+ * Allocate a chunk that is carved, or comes from a custom allocator.
+ */
+static void *nalloc_slow(size_t size, void *parent, bool zero)
+{
+	void *mem;
+
+	/* Snapshots are read-only. */
+	if (parent && unlikely(meta(parent) & CHUNK_SNAPSHOT))
+		return NULL;
+
+	if (!parent || !(meta(parent) & (CHUNK_ARENA | CHUNK_COMPACT |
+					 CHUNK_COMPACT_ROOT))) {
+		mem = backend_chunk(size, parent, parent ? backend_of(parent) :
+							   default_backend(),
+				    zero);
+	} else if (is_carved(parent)) {
+		if ((mem = arena_alloc(size, parent)) && zero)
+			memset(mem, 0, size);
+	} else {
+		/* compact_alloc() takes care of appending. */
+		if ((mem = compact_alloc(size, parent)) && zero)
+			memset(mem, 0, size);
+		return mem;
+	}
+
+	/* Chunks are linked in front of their siblings, move it behind. */
+	if (mem && appends(parent))
+		set_parent(mem, parent, true);
+
+	return mem;
+}
+
+/* Whether nalloc() has to take the slow path for a parent. */
+#define slow_parent(parent)                                              \
+	((parent) ? unlikely(meta(parent) & (CHUNK_ARENA | CHUNK_COMPACT | \
+					     CHUNK_COMPACT_ROOT |          \
+					     CHUNK_CUSTOM | CHUNK_APPEND)) \
+		  : unlikely(default_backend()))
+
+/* nalloc() and ncalloc(), without the statistics and the hooks. */
+static inline void *alloc_chunk(size_t size, void *parent, bool zero)
+{
+	void *mem;
+
+	if (unlikely(size > MAX_SIZE))
+		return NULL;
+
+	if (slow_parent(parent))
+		return nalloc_slow(size, parent, zero);
+
+	mem = raw_alloc(size + HEADER_SIZE, zero);
+	return nalloc_init(mem, size, self ? self->id : 0, parent);
+}
+
+EXPORT
+void *nalloc(size_t size, void *parent)
+{
+	return stat_alloc(alloc_chunk(size, parent, false), size);
+}
+
+EXPORT
+void *ncalloc(size_t size, void *parent)
+{
+	return stat_alloc(alloc_chunk(size, parent, true), size);
+}
+
+EXPORT
+void *nalloc_aligned(size_t size, size_t align, void *parent)
+{
+	if (unlikely(!align || (align & (align - 1))))
+		return NULL;
+
+	if (align <= NATURAL_ALIGN)
+		return nalloc(size, parent);
+
+	return stat_alloc(aligned_alloc_chunk(size, align, parent), size);
+}
+
+EXPORT
+void *ncalloc_aligned(size_t size, size_t align, void *parent)
+{
+	void *mem;
+
+	if (unlikely(!align || (align & (align - 1))))
+		return NULL;
+
+	if (align <= NATURAL_ALIGN)
+		return ncalloc(size, parent);
+
+	if ((mem = aligned_alloc_chunk(size, align, parent)))
+		memset(mem, 0, size);
+
+	return stat_alloc(mem, size);
+}
+
+#define atomic_link(link) ((_Atomic(void *) *)&(link))
+
+/**
+ * Link a detached chunk in front of the children of parent, concurrently
+ * with other threads doing the same.
+ *
+ * The new chunk takes the last child from its successor, whose prev link
+ * was set before it was published, and only the thread that links a chunk
+ * in front of another one writes the prev link of the latter again. The
+ * tail of the list is never touched, so next(last) stays tag(parent).
+ */
+static void concurrent_link(void *mem, void *parent)
+{
+	void *first = atomic_load_explicit(atomic_link(child(parent)),
+					   memory_order_acquire);
+
+#ifdef NALLOC_PARENT
+	parent(mem) = parent;
+#endif
+	do {
+		if (!first) {
+			next(mem) = tag(parent);
+			prev(mem) = mem;
+		} else {
+			next(mem) = first;
+			prev(mem) = atomic_load_explicit(atomic_link(prev(first)),
+							 memory_order_relaxed);
+		}
+	} while (!atomic_compare_exchange_weak_explicit(
+		atomic_link(child(parent)), &first, mem, memory_order_acq_rel,
+		memory_order_acquire));
+
+	if (first)
+		atomic_store_explicit(atomic_link(prev(first)), mem,
+				      memory_order_relaxed);
+}
+
+EXPORT
+void *nalloc_concurrent(size_t size, void *parent)
+{
+	void *mem;
+
+	if (!parent)
+		return nalloc(size, NULL);
+
+	if (unlikely(size > MAX_SIZE) ||
+	    (meta(parent) & (CHUNK_ARENA | CHUNK_COMPACT | CHUNK_COMPACT_ROOT)))
+		return NULL;
+
+	check_chunk(parent);
+	if ((mem = backend_chunk(size, NULL, backend_of(parent), false)))
+		concurrent_link(mem, parent);
+
+	return stat_alloc(mem, size);
+}
+
+static void *arena_root(size_t size, void *parent, size_t block_size,
+			int node, bool huge)
+{
+	unsigned shift = huge ? HUGE_SHIFT :
+		block_size ? ARENA_MIN_SHIFT : ARENA_DEFAULT_SHIFT;
+	struct arena *arena;
+	void *mem;
+
+	if (unlikely(size > MAX_SIZE) || (parent && in_compact(parent)))
+		return NULL;
+
+	while (((size_t)1 << shift) < block_size)
+		if (++shift == sizeof(size_t) * 8 - 2)
+			return NULL;
+
+	if (!(arena = arena_new(shift, parent ? backend_of(parent) :
+						default_backend(), huge)))
+		return NULL;
+
+	if (!arena_place(arena, node)) {
+		arena_destroy(arena);
+		return NULL;
+	}
+
+	mem = arena_carve(arena, size + HEADER_SIZE, &shift);
+	if (!(mem = nalloc_init(mem, size, shift, NULL)) ||
+	    !nested_fits(parent, arena->bytes)) {
+		arena_destroy(arena);
+		return NULL;
+	}
+
+	meta(mem) |= CHUNK_ARENA | CHUNK_ARENA_ROOT;
+	arena->root = mem;
+
+	set_parent(mem, parent, appends(parent));
+	return stat_alloc(mem, size);
+}
+
+EXPORT
+void *nalloc_arena(size_t size, void *parent, size_t block_size)
+{
+	return arena_root(size, parent, block_size, parent_node(parent), false);
+}
+
+EXPORT
+void *nalloc_arena_on_node(size_t size, void *parent, size_t block_size,
+			   int node)
+{
+	if (node >= MAX_NODES)
+		return NULL;
+
+	return arena_root(size, parent, block_size,
+			  node < 0 ? numa_node() : node, false);
+}
+
+EXPORT
+void *nalloc_arena_huge(size_t size, void *parent, size_t block_size)
+{
+	return arena_root(size, parent, block_size, parent_node(parent), true);
+}
+
+EXPORT
+void *nalloc_compact(size_t size, void *parent)
+{
+#if UINTPTR_MAX > UINT32_MAX
+	struct compact *region;
+	void *mem;
+
+	if (unlikely(size > MAX_SIZE) || (parent && in_compact(parent)))
+		return NULL;
+
+	if (!(region = (struct compact *)compact_reserve()))
+		return NULL;
+
+	if (mprotect(region, COMPACT_COMMIT, PROT_READ | PROT_WRITE)) {
+		munmap(region, COMPACT_SPAN);
+		return NULL;
+	}
+
+	region->top = (char *)region + ALIGN_UP(sizeof(*region), ARENA_GRAIN);
+	region->end = (char *)region + COMPACT_COMMIT;
+	region->outer = NULL;
+
+	mem = compact_carve(region, size + HEADER_SIZE);
+	if (!(mem = nalloc_init(mem, size, 0, NULL)) ||
+	    !nested_fits(parent, region->end - (char *)region)) {
+		munmap(region, COMPACT_SPAN);
+		return NULL;
+	}
+
+	meta(mem) |= CHUNK_COMPACT_ROOT;
+
+	set_parent(mem, parent, appends(parent));
+	return stat_alloc(mem, size);
+#else
+	(void)size;
+	(void)parent;
+	return NULL;
+#endif
+}
+
+EXPORT
+void **nalloc_array(size_t count, size_t size, void *parent, void **mem)
+{
+	size_t stride = ALIGN_UP(size + HEADER_SIZE, ARENA_GRAIN);
+	size_t total = BLOCK_HEADER + ARENA_HEADER;
+	struct arena *arena;
+	unsigned shift = 0;
+	void *last = NULL;
+
+	if (unlikely(size > MAX_SIZE) || count > (MAX_SIZE - total) / stride)
+		return NULL;
+
+	if (parent && unlikely(is_carved(parent) || in_compact(parent))) {
+		/*
+		 * Carve them one by one, last first to keep their order, or
+		 * first first when each one goes behind its siblings.
+		 */
+		bool append = appends(parent);
+
+		for (size_t n = 0; n < count; n++) {
+			if (!(mem[append ? n : count - 1 - n] =
+				      nalloc(size, parent))) {
+				while (n--)
+					nfree(mem[append ? n : count - 1 - n]);
+				return NULL;
+			}
+		}
+
+		return mem;
+	}
+
+	if (!count)
+		return mem;
+
+	for (total += count * stride; ((size_t)1 << shift) < total; shift++)
+		;
+
+	if (!(arena = arena_new(shift, parent ? backend_of(parent) :
+						default_backend(), false)))
+		return NULL;
+
+	/* Nothing owns the arena, it goes away with the last element. */
+	arena->dead = true;
+	arena->escaped = count;
+	arena->shift = ARENA_MIN_SHIFT;
+
+	for (size_t i = 0; i < count; i++) {
+		void *raw = arena->top;
+
+		arena->top += stride;
+		memset(raw, 0, HEADER_SIZE);
+		mem[i] = raw2usr(raw);
+		set_canary(mem[i]);
+		set_size(mem[i], size);
+		set_aux(mem[i], shift);
+		meta(mem[i]) |= CHUNK_ARENA | CHUNK_ESCAPED;
+
+		if (!parent)
+			continue;
+#ifdef NALLOC_PARENT
+		parent(mem[i]) = parent;
+#endif
+		if (last) {
+			next(last) = mem[i];
+			prev(mem[i]) = last;
+		}
+		last = mem[i];
+	}
+
+	if (parent) {
+		/*
+		 * Insert the elements in front of the children of parent, or
+		 * behind them when parent appends.
+		 */
+		void *first = child(parent);
+
+		if (!first) {
+			prev(mem[0]) = last;
+			next(last) = tag(parent);
+			child(parent) = mem[0];
+		} else if (!appends(parent)) {
+			prev(mem[0]) = prev(first);
+			next(last) = first;
+			prev(first) = last;
+			child(parent) = mem[0];
+		} else {
+			prev(mem[0]) = prev(first);
+			next(prev(first)) = mem[0];
+			next(last) = tag(parent);
+			prev(first) = last;
+		}
+	}
+
+#ifdef NALLOC_STATS
+	for (size_t i = 0; i < count; i++)
+		stat_alloc(mem[i], size);
+#endif
+	return mem;
+}
+
+EXPORT
+void *nalloc_with(size_t size, void *parent,
+		  const struct nalloc_allocator *ops)
+{
+	int id = backend_id(ops);
+	void *mem;
+
+	if (unlikely(size > MAX_SIZE) || id < 0)
+		return NULL;
+
+	if (parent && (is_carved(parent) || in_compact(parent)))
+		return nalloc(size, parent);
+
+	if ((mem = backend_chunk(size, parent, id, false)) && appends(parent))
+		set_parent(mem, parent, true);
+
+	return stat_alloc(mem, size);
+}
+
+/**
+ * Resize a memory chunk, making room for hint bytes where it can be found
+ * again (see raw_realloc()).
+ */
+static void *resize(void *usr, size_t size, size_t hint)
+{
+	size_t old = user_size(usr);
+	void *mem;
+
+	check_chunk(usr);
+
+	if (unlikely(meta(usr) & (CHUNK_ARENA | CHUNK_COMPACT |
+				  CHUNK_COMPACT_ROOT | CHUNK_ALIGNED |
+				  CHUNK_CUSTOM))) {
+		if (meta(usr) & CHUNK_SNAPSHOT)
+			return NULL;
+		else if (meta(usr) & CHUNK_ALIGNED)
+			mem = aligned_realloc(usr, size);
+		else if (is_carved(usr))
+			mem = arena_realloc(usr, size);
+		else if (meta(usr) & CHUNK_CUSTOM)
+			mem = backend_realloc(usr, size);
+		else
+			mem = compact_realloc(usr, size);
+	} else if ((mem = raw_realloc(usr2raw(usr), old + HEADER_SIZE,
+				      size + HEADER_SIZE, hint + HEADER_SIZE))) {
+		mem = raw2usr(mem);
+		set_size(mem, size);
+
+		/* If the buffer starting address changed, update all references. */
+		if (mem != usr)
+			relink(mem, usr);
+	}
+
+	if (mem && mem != usr && unlikely(meta(mem) & CHUNK_DESTRUCTOR))
+		destructor_move(mem, usr);
+
+	stat_realloc(mem, usr, old, size);
+	return mem;
+}
+
+EXPORT
+void *nalloc_clone(const void *mem, void *parent)
+{
+	if (unlikely(!mem) || (parent && in_compact(parent)))
+		return NULL;
+
+	return clone_tree(mem, parent, parent);
+}
+
+EXPORT
+void *nalloc_defrag(void *mem)
+{
+	void *parent, *copy;
+	size_t count, steps = 0;
+
+	if (unlikely(!mem) || unlikely(meta(mem) & CHUNK_SNAPSHOT) ||
+	    ((parent = get_parent(mem, &steps)) && in_compact(parent)))
+		return NULL;
+
+	if (!(copy = clone_tree(mem, NULL, mem)))
+		return NULL;
+
+	if (meta(mem) & CHUNK_ARENA_ROOT) {
+		/* The copy takes over the budget of the arena. */
+		arena_of(copy)->limit = arena_of(mem)->limit;
+		arena_of(copy)->pressure = arena_of(mem)->pressure;
+	}
+
+	pthread_mutex_lock(&destructors.lock);
+	count = destructors.count;
+	pthread_mutex_unlock(&destructors.lock);
+
+	if (count)
+		clone_destructors(copy, mem);
+
+	/* Take the place of the original among its siblings. */
+	if (parent) {
+		next(copy) = next(mem);
+		prev(copy) = prev(mem);
+#ifdef NALLOC_PARENT
+		parent(copy) = parent;
+#endif
+		relink(copy, mem);
+		next(mem) = prev(mem) = NULL;
+
+		if (meta(mem) & CHUNK_FOREIGN) {
+			unnest(mem, arena_of(parent));
+			meta(mem) &= ~CHUNK_FOREIGN;
+			meta(copy) |= CHUNK_FOREIGN;
+			nest(copy, arena_of(parent));
+		} else if (is_carved(parent)) {
+			meta(copy) |= CHUNK_FOREIGN;
+			arena_of(parent)->foreign++;
+			nest(copy, arena_of(parent));
+		}
+	}
+
+	nfree(mem);
+	return copy;
+}
+
+EXPORT
+void *nrealloc(void *usr, size_t size)
+{
+	if (unlikely(!usr))
+		return nalloc(size, NULL);
+
+	if (unlikely(size > MAX_SIZE))
+		return NULL;
+
+	return resize(usr, size, size);
+}
+
+EXPORT
+void *nrealloc_reserve(void *usr, size_t min, size_t hint)
+{
+	if (unlikely(min > MAX_SIZE))
+		return NULL;
+
+	if (unlikely(!usr) && !(usr = nalloc(0, NULL)))
+		return NULL;
+
+	return resize(usr, min, hint < min ? min : hint > MAX_SIZE ? MAX_SIZE :
+								       hint);
+}
+
+/**
+ * Parallel frees.
+ *
+ * nfree_parallel() hands the tree out to workers a batch of siblings at a
+ * time, taken under a lock from a stack of sibling lists, which starts with
+ * the children of the root. A worker that empties the stack splits the
+ * first chunk with children of its batch instead of freeing it: it pushes
+ * the children on the stack, and leaves the chunk to be freed once all the
+ * workers are done, after its descendants. Chunks whose release touches
+ * state they share with other chunks (an arena, a compact region, or a
+ * custom allocator) are freed one subtree at a time, under another lock.
+ */
+
+#define PARALLEL_BATCH 64
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_LISTS (PARALLEL_MAX_THREADS * 2)
+
+#define CHUNK_SHARED \
+	(CHUNK_ARENA | CHUNK_COMPACT_ROOT | CHUNK_CUSTOM | CHUNK_SNAPSHOT)
+
+struct nfree_job {
+	pthread_mutex_t lock, shared;
+	pthread_cond_t wake;
+	void *lists[PARALLEL_LISTS]; /* Siblings left to free, from the first. */
+	unsigned count;              /* Number of lists. */
+	unsigned busy;               /* Workers freeing a batch. */
+	void *split;                 /* Split chunks, linked through next. */
+};
+
+static void nfree_shared(struct nfree_job *job, void *mem);
+
+/* Whether a chunk is an arena tree that goes away with its blocks. */
+static inline bool self_contained(void *mem)
+{
+	return unlikely(meta(mem) & CHUNK_ARENA_ROOT) &&
+	       !arena_of(mem)->foreign && !arena_of(mem)->destructors;
+}
+
+/**
+ * Take a step of the deallocation of a detached chunk and all of its
+ * descendants, descending into a child or freeing a chunk without any.
+ *
+ * The walk runs in constant stack space: the chunk being descended into is
+ * pushed on a work list threaded through its (no longer needed) next link,
+ * while the parent keeps the rest of its children in its child link. An
+ * arena tree met on the way is released with its blocks, as nfree() does.
+ *
+ * @param mem  pointer to the chunk the walk is at, initially the root.
+ * @param job  parallel free the walk is part of, or NULL.
+ *
+ * @return the chunk the walk goes on at, or NULL once it is done.
+ */
+static inline void *nfree_step(void *mem, struct nfree_job *job)
+{
+	void *next = child(mem);
+
+	if (next) {
+		if (job && unlikely(meta(next) & CHUNK_SHARED)) {
+			child(mem) = sibling(next);
+			nfree_shared(job, next);
+			return mem;
+		}
+
+		if (unlikely(meta(next) & (CHUNK_FOREIGN | CHUNK_COMPACT))) {
+			if (meta(next) & CHUNK_COMPACT) {
+				/* They go away with the region. */
+				child(mem) = NULL;
+				return mem;
+			}
+
+			arena_of(mem)->foreign--;
+			unnest(next, arena_of(mem));
+		}
+
+		if (self_contained(next)) {
+			/* Release an arena tree with its blocks, not node by node. */
+			check_chunk(next);
+			child(mem) = sibling(next);
+			arena_free(next);
+			return mem;
+		}
+
+		/* Fail if the tree hierarchy has cycles. */
+#if NALLOC_HARDEN
+		if (unlikely(!prev(next)))
+			harden_fail("cycle", next);
+#else
+		assert(prev(next));
+#endif
+		prev(next) = NULL;
+
+		child(mem) = sibling(next);
+		next(next) = mem;
+	} else {
+		next = next(mem);
+		check_chunk(mem);
+		if (unlikely(meta(mem) & CHUNK_DESTRUCTOR))
+			destructor_run(mem);
+		chunk_free(mem);
+	}
+
+	return next;
+}
+
+/**
+ * Deallocate a detached chunk and all of its descendants.
+ *
+ * @param mem  pointer to previously nalloc'ed root memory chunk.
+ */
+static inline void __nfree(void *mem)
+{
+	while (mem)
+		mem = nfree_step(mem, NULL);
+}
+
+/**
+ * Deferred frees.
+ *
+ * Trees handed to nfree_deferred() are pushed on a lock-free stack, linked
+ * through the prev link of their (detached) root. nalloc_reclaim() moves
+ * them to its own queue, and frees them one walk step at a time, keeping
+ * the chunk its walk is at between the calls.
+ */
+
+#define RECLAIM_STEPS 64
+
+static struct {
+	pthread_mutex_t lock;
+	_Atomic(void *) pending; /* Trees pushed by nfree_deferred(). */
+	void *queue;             /* Trees taken from pending, not started. */
+	void *walk;              /* Where the current walk is at, or NULL. */
+} reclaim = { PTHREAD_MUTEX_INITIALIZER };
+
+static double reclaim_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+EXPORT
+void *nfree(void *mem)
+{
+	if (unlikely(!mem))
+		return NULL;
+
+	if (unlikely(meta(mem) & CHUNK_SNAPSHOT)) {
+		/* Snapshots are read-only, and only go away as a whole. */
+		if (!compact_prev(mem))
+			compact_destroy(mem);
+		return NULL;
+	}
+
+	check_chunk(mem);
+	set_parent(mem, NULL, false);
+	stat_free(mem);
+
+	/* Compact chunks are only released with their region. */
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return NULL;
+
+	if (self_contained(mem))
+		arena_free(mem);
+	else
+		__nfree(mem);
+
+	return NULL;
+}
+
+EXPORT
+void *nfree_deferred(void *mem)
+{
+	void *head;
+
+	if (unlikely(!mem))
+		return NULL;
+
+	if (unlikely(meta(mem) & CHUNK_COMPACT))
+		return nfree(mem);
+
+	set_parent(mem, NULL, false);
+
+	head = atomic_load_explicit(&reclaim.pending, memory_order_relaxed);
+	do
+		prev(mem) = head;
+	while (!atomic_compare_exchange_weak_explicit(&reclaim.pending, &head,
+						      mem, memory_order_release,
+						      memory_order_relaxed));
+
+	return NULL;
+}
+
+EXPORT
+int nalloc_reclaim(size_t budget_ns)
+{
+	double deadline = reclaim_clock() + (double)budget_ns;
+	unsigned steps = 0;
+	void *mem;
+	int left;
+
+	pthread_mutex_lock(&reclaim.lock);
+	for (mem = reclaim.walk;; steps++) {
+		if (!mem) {
+			if (!reclaim.queue)
+				reclaim.queue = atomic_exchange_explicit(
+					&reclaim.pending, NULL,
+					memory_order_acquire);
+
+			if (!(mem = reclaim.queue))
+				break;
+
+			reclaim.queue = prev(mem);
+			prev(mem) = NULL;
+			stat_free(mem);
+
+			if (self_contained(mem)) {
+				arena_free(mem);
+				mem = NULL;
+				continue;
+			}
+		}
+
+		if (budget_ns && steps % RECLAIM_STEPS == RECLAIM_STEPS - 1 &&
+		    reclaim_clock() >= deadline)
+			break;
+
+		mem = nfree_step(mem, NULL);
+	}
+
+	reclaim.walk = mem;
+	left = mem || reclaim.queue ||
+	       atomic_load_explicit(&reclaim.pending, memory_order_relaxed);
+	pthread_mutex_unlock(&reclaim.lock);
+
+	return left;
+}
+
+/* Free a subtree whose root shares state with other chunks. */
+static COLD void nfree_shared(struct nfree_job *job, void *mem)
+{
+	prev(mem) = next(mem) = NULL;
+
+	pthread_mutex_lock(&job->shared);
+	if (self_contained(mem))
+		arena_free(mem);
+	else
+		__nfree(mem);
+	pthread_mutex_unlock(&job->shared);
+}
+
+/*
+ * Take a batch of siblings from the top of the stack, waiting for the other
+ * workers to push some while they are busy.
+ */
+static unsigned nfree_take(struct nfree_job *job, void **batch, bool *split)
+{
+	unsigned n = 0;
+	void *mem;
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->count && job->busy)
+		pthread_cond_wait(&job->wake, &job->lock);
+
+	if (job->count) {
+		mem = job->lists[job->count - 1];
+		for (; n < PARALLEL_BATCH && mem; mem = sibling(mem))
+			batch[n++] = mem;
+		if (mem)
+			job->lists[job->count - 1] = mem;
+		else
+			job->count--;
+
+		*split = !job->count;
+		job->busy++;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return n;
+}
+
+/* Push the children of a chunk on the stack, if there is room. */
+static bool nfree_split(struct nfree_job *job, void *mem)
+{
+	bool room;
+
+	pthread_mutex_lock(&job->lock);
+	if ((room = job->count < PARALLEL_LISTS)) {
+		job->lists[job->count++] = child(mem);
+		child(mem) = NULL;
+		next(mem) = job->split;
+		job->split = mem;
+		pthread_cond_broadcast(&job->wake);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return room;
+}
+
+static void *nfree_worker(void *arg)
+{
+	struct nfree_job *job = arg;
+	void *batch[PARALLEL_BATCH], *mem;
+	unsigned n;
+	bool split;
+
+	while ((n = nfree_take(job, batch, &split))) {
+		for (unsigned i = 0; i < n; i++) {
+			mem = batch[i];
+			prev(mem) = next(mem) = NULL;
+
+			if (unlikely(meta(mem) & CHUNK_SHARED)) {
+				nfree_shared(job, mem);
+				continue;
+			}
+
+			if (split && child(mem) && nfree_split(job, mem)) {
+				split = false;
+				continue;
+			}
+
+			while (mem)
+				mem = nfree_step(mem, job);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		if (!--job->busy && !job->count)
+			pthread_cond_broadcast(&job->wake);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+}
+
+EXPORT
+void *nfree_parallel(void *mem, unsigned nthreads)
+{
+	pthread_t threads[PARALLEL_MAX_THREADS - 1];
+	struct nfree_job job = { .count = 1 };
+	unsigned started = 0;
+
+	if (unlikely(!mem))
+		return NULL;
+
+	if (nthreads < 2 || !child(mem) ||
+	    (meta(mem) & (CHUNK_SHARED | CHUNK_COMPACT)))
+		return nfree(mem);
+
+	check_chunk(mem);
+	set_parent(mem, NULL, false);
+	stat_free(mem);
+
+	job.lists[0] = child(mem);
+	child(mem) = NULL;
+	job.split = mem;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_mutex_init(&job.shared, NULL);
+	pthread_cond_init(&job.wake, NULL);
+
+	if (nthreads > PARALLEL_MAX_THREADS)
+		nthreads = PARALLEL_MAX_THREADS;
+	while (started < nthreads - 1 &&
+	       !pthread_create(&threads[started], NULL, nfree_worker, &job))
+		started++;
+
+	nfree_worker(&job);
+	while (started)
+		pthread_join(threads[--started], NULL);
+
+	/* Split chunks come after their descendants, the root last. */
+	__nfree(job.split);
+
+	pthread_cond_destroy(&job.wake);
+	pthread_mutex_destroy(&job.shared);
+	pthread_mutex_destroy(&job.lock);
+	return NULL;
+}
+
+EXPORT
+void *nalloc_get_parent(const void *mem)
+{
+	size_t steps = 0;
+
+	if (unlikely(!mem))
+		return NULL;
+
+	STAT(LOOKUPS, 1);
+	mem = get_parent(mem, &steps);
+	STAT(LOOKUP_STEPS, steps);
+	return (void *)mem;
+}
+
+EXPORT
+void *nalloc_first_child(const void *mem)
+{
+	return unlikely(!mem) ? NULL : first_child(mem);
+}
+
+EXPORT
+void *nalloc_next_sibling(const void *mem)
+{
+	return unlikely(!mem) ? NULL : next_sibling(mem);
+}
+
+EXPORT
+void nalloc_walk(void *mem, int (*pre)(void *mem, void *ctx),
+		 void (*post)(void *mem, void *ctx), void *ctx)
+{
+	enum step step = STEP_DOWN;
+	void *node = mem, *next;
+
+	while (node) {
+		if (step != STEP_UP) {
+			/* Both are next to be visited, one way or the other. */
+			prefetch_header(first_child(node));
+			prefetch_header(node == mem ? NULL : next_sibling(node));
+
+			if (pre && pre(node, ctx))
+				step = STEP_UP;
+		}
+
+		/* A chunk is left once the walk does not go down from it. */
+		next = walk_next(node, mem, &step);
+		if (post && step != STEP_DOWN)
+			post(node, ctx);
+		node = next;
+	}
+}
+
+EXPORT
+void nalloc_set_parent(void *mem, void *parent)
+{
+	STAT(REPARENTS, 1);
+	set_parent(mem, parent, false);
+}
+
+EXPORT
+void nalloc_append(void *mem, void *parent)
+{
+	STAT(REPARENTS, 1);
+	set_parent(mem, parent, true);
+}
+
+EXPORT
+void *nalloc_mark(const void *parent)
+{
+	if (unlikely(!parent))
+		return NULL;
+
+	return appends(parent) ? last_child(parent) : first_child(parent);
+}
+
+EXPORT
+int nalloc_rollback(void *parent, const void *mark)
+{
+	void *child;
+	bool append;
+
+	/* Snapshot chunks are not freed one by one. */
+	if (unlikely(!parent) || unlikely(meta(parent) & CHUNK_SNAPSHOT))
+		return -1;
+
+	/* Children allocated since the mark are the ones on its newer side. */
+	append = appends(parent);
+	for (child = append ? last_child(parent) : first_child(parent);
+	     child != mark;
+	     child = append ? prev_sibling(child) : next_sibling(child))
+		if (!child)
+			/* Free nothing if the mark is no longer a child. */
+			return -1;
+
+	while ((child = append ? last_child(parent) : first_child(parent)) !=
+	       mark)
+		nfree(child);
+
+	return 0;
+}
+
+EXPORT
+void nalloc_move_range(void *first, void *last, void *parent)
+{
+	void *node, *next;
+
+	if (unlikely(!first || !last))
+		return;
+
+	STAT(REPARENTS, 1);
+
+	if (likely(parent && range_fits(first, parent)) && NALLOC_HARDEN < 2) {
+		move_range(first, last, parent);
+		return;
+	}
+
+	for (node = first; node; node = next) {
+		next = node == last ? NULL : next_sibling(node);
+		set_parent(node, parent, true);
+	}
+}
+
+EXPORT
+int nalloc_set_append(void *mem, int append)
+{
+	if (unlikely(!mem) || unlikely(meta(mem) & CHUNK_SNAPSHOT))
+		return -1;
+
+	if (append)
+		meta(mem) |= CHUNK_APPEND;
+	else
+		meta(mem) &= ~CHUNK_APPEND;
+
+	return 0;
+}
+
+EXPORT
+void nalloc_cut(void *mem, void *parent)
+{
+	void *first, *last;
+	size_t steps = 0;
+
+	if (unlikely(!mem))
+		return;
+
+	if (unlikely(meta(mem) & CHUNK_SNAPSHOT)) {
+		/* Snapshots are read-only. */
+		assert(false);
+		return;
+	}
+
+#if NALLOC_HARDEN >= 2
+	if (unlikely(is_ancestor(mem, parent))) {
+		/* Refuse to move the children below one of them. */
+		assert(false);
+		return;
+	}
+#endif
+
+	STAT(CUTS, 1);
+	set_parent(mem, NULL, false);
+
+	if (unlikely(in_compact(mem))) {
+		compact_cut(mem, parent);
+		return;
+	}
+
+	if (!(first = child(mem)))
+		return;
+
+	if (unlikely(!links_fit(first, parent))) {
+		/* Fail if the children can not link to their new parent. */
+		assert(false);
+		return;
+	}
+
+	if (!parent || unlikely(is_carved(mem)) || unlikely(is_carved(parent))) {
+		/* Move the children one by one, last first to keep their order. */
+		for (; child(mem); steps++)
+			set_parent(last(mem), parent, false);
+
+		STAT(CUT_STEPS, steps);
+		return;
+	}
+
+#ifdef NALLOC_PARENT
+	for (void *child = first; child; child = sibling(child), steps++)
+		parent(child) = parent;
+#endif
+	STAT(CUT_STEPS, steps);
+
+	/* Insert mem children in front of the list of parent children. */
+	last = prev(first);
+
+	if (child(parent)) {
+		prev(first) = last(parent);
+		next(last) = child(parent);
+		prev(child(parent)) = last;
+	} else
+		next(last) = tag(parent);
+
+	child(parent) = first;
+	child(mem) = NULL;
+}
+
+EXPORT
+int nalloc_set_destructor(void *mem, void (*destructor)(void *mem))
+{
+	if (unlikely(!mem) || unlikely(meta(mem) & CHUNK_COMPACT))
+		return -1;
+
+	return destructor_set(mem, destructor) ? 0 : -1;
+}
+
+EXPORT
+int nalloc_set_limit(void *root, size_t bytes,
+		     void (*pressure)(void *root, size_t used, size_t size))
+{
+	struct arena *arena;
+
+	if (unlikely(!root) || !(meta(root) & CHUNK_ARENA_ROOT))
+		return -1;
+
+	arena = arena_of(root);
+	arena->limit = bytes;
+	arena->pressure = pressure;
+	return 0;
+}
+
+EXPORT
+void nalloc_subtree_stats(const void *mem, struct nalloc_stats *stats)
+{
+	enum step step = STEP_DOWN;
+	size_t depth = 0, fanout;
+	const void *child;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (const void *node = mem; node; node = walk_next(node, mem, &step)) {
+		if (step == STEP_UP) {
+			depth--;
+			continue;
+		}
+
+		stats->nodes++;
+		stats->bytes += user_size(node);
+
+		if ((child = first_child(node))) {
+			for (fanout = 0; child; child = next_sibling(child))
+				fanout++;
+			if (fanout > stats->fanout)
+				stats->fanout = fanout;
+
+			if (++depth > stats->depth)
+				stats->depth = depth;
+		}
+	}
+}
+
+EXPORT
+void *nalloc_tagged(size_t size, void *parent, const char *tag)
+{
+	void *mem = alloc_chunk(size, parent, false);
+
+	/* Tag it before the hook sees it. */
+	if (mem && !(meta(mem) & CHUNK_COMPACT))
+		set_site(mem, tag);
+
+	return stat_alloc(mem, size);
+}
+
+EXPORT
+int nalloc_dump_profile(const void *mem, FILE *fp)
+{
+	struct frame root = { 0 }, *frame;
+	const void *node = mem, *next;
+	enum step step = STEP_DOWN;
+	int ret;
+
+	if (unlikely(!mem))
+		return -1;
+
+	for (frame = &root; node; node = next) {
+		if (step != STEP_UP && !(frame = frame_enter(frame, node)))
+			break;
+
+		/* Pop the frame of a chunk as the walk leaves it. */
+		next = walk_next(node, mem, &step);
+		if (step != STEP_DOWN && frame->owner == node)
+			frame = frame->up;
+	}
+
+	ret = frame ? profile_print(&root, fp) : -1;
+	frame_free(&root);
+	return ret;
+}
+
+EXPORT
+size_t nalloc_snapshot(const void *mem, void *buf, size_t size)
+{
+#if UINTPTR_MAX > UINT32_MAX
+	uint64_t total;
+
+	if (unlikely(!mem) || !(total = snapshot_write(mem, NULL)))
+		return 0;
+
+	if (buf && size >= total)
+		snapshot_write(mem, buf);
+
+	return total;
+#else
+	(void)mem;
+	(void)buf;
+	(void)size;
+	return 0;
+#endif
+}
+
+EXPORT
+void *nalloc_snapshot_map(int fd)
+{
+#if UINTPTR_MAX > UINT32_MAX
+	struct snapshot *image;
+	struct stat st;
+	char *region;
+
+	if (fstat(fd, &st) || (uint64_t)st.st_size < SNAPSHOT_HEADER ||
+	    (uint64_t)st.st_size > COMPACT_SPAN || !(region = compact_reserve()))
+		return NULL;
+
+	if (mmap(region, st.st_size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) ==
+	    MAP_FAILED) {
+		munmap(region, COMPACT_SPAN);
+		return NULL;
+	}
+
+	image = (struct snapshot *)region;
+	if (image->magic != SNAPSHOT_MAGIC ||
+	    image->size > (uint64_t)st.st_size ||
+	    image->root < SNAPSHOT_HEADER + COMPACT_HEADER ||
+	    image->root >= image->size) {
+		munmap(region, COMPACT_SPAN);
+		return NULL;
+	}
+
+	return region + image->root;
+#else
+	(void)fd;
+	return NULL;
+#endif
+}
+
+EXPORT
+void nalloc_counters(struct nalloc_counters *counters)
+{
+	memset(counters, 0, sizeof(*counters));
+
+#ifdef NALLOC_STATS
+	size_t count[STAT_COUNT];
+
+	pthread_mutex_lock(&stats.lock);
+	for (unsigned i = 0; i < STAT_COUNT; i++) {
+		count[i] = stats.exited[i] + stats.spill.count[i];
+		for (struct counters *c = stats.all; c; c = c->next)
+			count[i] += atomic_load_explicit(&c->count[i],
+							 memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&stats.lock);
+
+	counters->allocs = count[STAT_ALLOCS];
+	counters->frees = count[STAT_FREES];
+	counters->moves = count[STAT_MOVES];
+	counters->reparents = count[STAT_REPARENTS];
+	counters->lookups = count[STAT_LOOKUPS];
+	counters->lookup_steps = count[STAT_LOOKUP_STEPS];
+	counters->cuts = count[STAT_CUTS];
+	counters->cut_steps = count[STAT_CUT_STEPS];
+	counters->bytes = count[STAT_ALLOC_BYTES] - count[STAT_FREE_BYTES];
+#endif
+}
+
+EXPORT
+void nalloc_hooks(void (*on_alloc)(void *mem, size_t size),
+		  void (*on_free)(void *mem))
+{
+#ifdef NALLOC_STATS
+	atomic_store(&stats.on_alloc, on_alloc);
+	atomic_store(&stats.on_free, on_free);
+#else
+	(void)on_alloc;
+	(void)on_free;
+#endif
+}
+
+EXPORT
+int nalloc_set_allocator(const struct nalloc_allocator *ops)
+{
+	int id = backend_id(ops);
+
+	if (id < 0)
+		return -1;
+
+	atomic_store_explicit(&backends.global, id, memory_order_release);
+	return 0;
+}
+
+EXPORT
+void nalloc_cache_limit(size_t bytes)
+{
+	pthread_mutex_lock(&cache.lock);
+	cache.limit = bytes;
+	pthread_mutex_unlock(&cache.lock);
+
+	cache_shrink(bytes);
+}
+
+EXPORT
+void nalloc_cache_trim(void)
+{
+	struct nalloc__tcache *t = self;
+
+#if NALLOC_HARDEN >= 3
+	quarantine_flush();
+#endif
+
+	if (t) {
+		tcache_drain(t);
+
+		for (unsigned class = 0; class < CACHE_CLASSES; class++) {
+			while (t->count[class])
+				free(t->mag[class][--t->count[class]]);
+		}
+	}
+
+	/* Nobody else is going to drain the queues of exited threads. */
+	pthread_mutex_lock(&threads.lock);
+	for (unsigned id = 1; id <= threads.count; id++) {
+		if (!threads.all[id]->used)
+			free_list(atomic_exchange(&threads.all[id]->remote,
+						  NULL));
+	}
+	pthread_mutex_unlock(&threads.lock);
+
+	cache_shrink(0);
 }
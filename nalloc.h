@@ -10,6 +10,39 @@
  *       a given chunk of memory. Once a chunk is allocated with *nalloc*,
  *       it can only be freed with *nfree*.
  *
+ * @note Nalloc functions can be called from any number of threads, as long
+ *       as a tree is only used by one thread at a time. nalloc(), ncalloc(),
+ *       nrealloc() and nfree() write to the links of the given chunk, of its
+ *       parent and of its siblings; nalloc_set_parent() and nalloc_cut()
+ *       also write to the tree of the new parent, so both trees must be
+ *       owned by the calling thread. nalloc_get_parent() only reads links,
+ *       and can run concurrently with other readers of the same tree, as
+ *       can the walks of a subtree: nalloc_walk(), nalloc_subtree_stats(),
+ *       nalloc_dump_profile(), and nalloc_clone() and nalloc_snapshot() on
+ *       the subtree they copy. These walks run in constant stack space. An
+ *       arena and every chunk carved out of it, including the ones moved out
+ *       of the arena tree, count as a single tree. A detached chunk (see
+ *       nalloc_set_parent()) can be handed over to another thread, and a
+ *       chunk can be freed by another thread than the one that allocated it.
+ *
+ * @note Building nalloc with NALLOC_HARDEN=1 adds a canary to each header,
+ *       and aborts with a message on a double free or a corrupted header.
+ *       NALLOC_HARDEN=2 also poisons freed memory and refuses a
+ *       nalloc_set_parent() that would make a cycle, and NALLOC_HARDEN=3
+ *       also delays the reuse of freed chunks to detect writes after free.
+ *       Compact chunks have no canary.
+ *
+ * @note Defining NALLOC_INLINE before including nalloc.h turns nalloc(),
+ *       nfree() and nalloc_get_parent() into macros calling inline fast
+ *       paths, from nalloc_inline.h, that fall back to the functions of the
+ *       library for the cases they do not handle. The program still links
+ *       with nalloc, which must be built with the same NALLOC_PARENT,
+ *       NALLOC_STATS, NALLOC_HARDEN and NALLOC_PROFILE options: it fails to
+ *       link otherwise. NALLOC_STATS and NALLOC_HARDEN disable the fast
+ *       paths. Programs can also get the whole of nalloc inlined into them
+ *       by linking with libnalloc.a, from make lib, with link-time
+ *       optimization.
+ *
  * Use:
  * @code
  *   struct matrix { size_t rows, cols; int **data; };
@@ -33,6 +66,7 @@
  */
 
 #include <stddef.h>
+#include <stdio.h>
 
 /**
  * Allocate a (contiguous) memory chunk.
@@ -56,6 +90,219 @@ void *nalloc(size_t size, void *parent);
  */
 void *ncalloc(size_t size, void *parent);
 
+/**
+ * Allocate a (contiguous) memory chunk aligned to a given boundary.
+ *
+ * Chunks returned by nalloc() are aligned to 16 bytes on 64-bit targets
+ * (8 bytes when built with one of NALLOC_PARENT, NALLOC_HARDEN and
+ * NALLOC_PROFILE, or with all three), and asking for that much or less
+ * is free. Chunks with a larger alignment are padded in front of their
+ * header and requested from the system allocator, even below an arena, and
+ * can not depend on a compact chunk. nrealloc() keeps their alignment.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param align   alignment of the memory chunk, a power of two.
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_aligned(size_t size, size_t align, void *parent);
+
+/**
+ * Allocate a zeroed (contiguous) memory chunk aligned to a given boundary,
+ * see nalloc_aligned().
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param align   alignment of the memory chunk, a power of two.
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *ncalloc_aligned(size_t size, size_t align, void *parent);
+
+/**
+ * Allocate a (contiguous) memory chunk, from any number of threads at once.
+ *
+ * The chunk is linked in front of the children of parent with a
+ * compare-and-swap, so threads can add children to a shared parent without
+ * holding a lock, even when it appends its children (see
+ * nalloc_set_append()). The order of the children is the reverse of the
+ * order in which they were linked.
+ *
+ * While nalloc_concurrent() may run for a parent, its children can not be
+ * freed, reallocated or moved, and neither the parent nor its child list
+ * can be used by any other function. A thread can still allocate children
+ * under the chunks it got from nalloc_concurrent() and use them, since this
+ * does not touch their siblings. The threads have to synchronize (for
+ * instance by being joined) before the parent is used, and freed, again.
+ *
+ * Chunks can not be allocated this way below an arena or a compact chunk,
+ * whose memory is carved by the thread that owns the tree.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_concurrent(size_t size, void *parent);
+
+/**
+ * Allocate a (contiguous) memory chunk that owns an arena.
+ *
+ * All the chunks allocated below it, directly or through any of its
+ * descendants, are carved out of large blocks owned by the arena instead of
+ * being requested one by one from malloc. Freeing the arena chunk, or any
+ * of its ancestors, releases those blocks at once, without walking the
+ * arena tree.
+ *
+ * Carved chunks can be reallocated and freed individually, but their memory
+ * is only given back with the arena, or to the arena when freed in reverse
+ * carving order. A carved chunk moved out of the arena tree is flagged as
+ * escaped and keeps the arena blocks alive until it is freed. A chunk moved
+ * into the arena tree is released with it as usual.
+ *
+ * @param size        amount of memory requested (in bytes).
+ * @param parent      pointer to allocated memory chunk from which this
+ *                    chunk depends, or NULL.
+ * @param block_size  size of the arena blocks (rounded up to a power of two),
+ *                    or 0 for the default.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_arena(size_t size, void *parent, size_t block_size);
+
+/**
+ * Allocate a memory chunk that owns an arena placed on a NUMA node, like
+ * nalloc_arena(). The arena blocks prefer that node whichever thread touches
+ * them first, and so do the chunks allocated below the arena chunk. Arenas
+ * created below it with nalloc_arena(), and copies made below it with
+ * nalloc_clone(), inherit the node. Chunks that are not carved from the
+ * arena, such as aligned chunks, are placed as usual. The blocks get the
+ * default policy back before they return to their allocator, so memory it
+ * hands out later is not tied to the node. Without NUMA support, the node
+ * is ignored.
+ *
+ * @param size        amount of memory requested (in bytes).
+ * @param parent      pointer to allocated memory chunk from which this
+ *                    chunk depends, or NULL.
+ * @param block_size  size of the arena blocks (rounded up to a power of two),
+ *                    or 0 for the default.
+ * @param node        NUMA node of the arena, or -1 for the node the calling
+ *                    thread runs on.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an
+ *         error or the node does not exist.
+ */
+void *nalloc_arena_on_node(size_t size, void *parent, size_t block_size,
+			   int node);
+
+/**
+ * Allocate a memory chunk that owns an arena mapped on huge pages, like
+ * nalloc_arena(). The arena blocks are at least 2 MiB large and are mapped
+ * on reserved huge pages when the system has some, 1 GiB ones for blocks at
+ * least that large, or on transparent huge pages otherwise. Large trees thus
+ * take far fewer TLB entries to traverse. Blocks are mapped directly instead
+ * of coming from the allocator of the parent, and freeing the arena chunk
+ * unmaps each block with a single call. A block size matching the expected
+ * size of the tree keeps the whole arena in one block.
+ *
+ * @param size        amount of memory requested (in bytes).
+ * @param parent      pointer to allocated memory chunk from which this
+ *                    chunk depends, or NULL.
+ * @param block_size  size of the arena blocks (rounded up to a power of two,
+ *                    at least 2 MiB), or 0 for 2 MiB.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_arena_huge(size_t size, void *parent, size_t block_size);
+
+/**
+ * Allocate a (contiguous) memory chunk that owns a compact arena.
+ *
+ * The chunks allocated below it are carved out of a 4 GiB region reserved
+ * for the arena, and link to each other with 32-bit offsets: their header
+ * takes 16 bytes instead of 32 (40 with NALLOC_PARENT). A compact chunk can
+ * be at most 1 MiB large, and allocating or resizing one past that returns
+ * NULL. Freeing the arena chunk releases the region at once.
+ *
+ * Compact chunks can be reallocated, reparented within the arena tree and
+ * freed individually, but their memory is only given back with the arena.
+ * They can not be moved out of the arena tree (a detached compact chunk
+ * still goes away with the arena), and other chunks can not be moved in.
+ * Only available on 64-bit targets.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_compact(size_t size, void *parent);
+
+/**
+ * Allocate count (contiguous) memory chunks of the same size, depending on
+ * the same parent, in a single allocation.
+ *
+ * The chunks are carved out of one arena block, and inserted in order in
+ * front of the children of parent, or after them when parent appends (see
+ * nalloc_set_append()). They behave as chunks carved out of an
+ * arena (see nalloc_arena()) that nothing owns: each one can be reallocated,
+ * reparented and freed on its own, and the block is released with the last
+ * one. Chunks allocated below them are carved out of the same arena. Below
+ * a carved or compact chunk, they are allocated one by one.
+ *
+ * @param count   number of memory chunks.
+ * @param size    amount of memory requested for each chunk (in bytes).
+ * @param parent  pointer to allocated memory chunk from which the
+ *                chunks depend, or NULL.
+ * @param mem     array of count pointers receiving the memory chunks.
+ *
+ * @return mem, or NULL if there was an error.
+ */
+void **nalloc_array(size_t count, size_t size, void *parent, void **mem);
+
+/**
+ * Copy a memory chunk and all the chunks depending on it, keeping the shape
+ * of the subtree and the order of the children, in a single allocation.
+ *
+ * The copies are carved, in pre-order, out of one block of a new arena
+ * owned by the copy of mem (see nalloc_arena()), so freeing it releases the
+ * whole copy at once. Only the contents of the chunks are copied: pointers
+ * stored in them are not relocated and destructors are not copied. Copies
+ * of chunks from nalloc_aligned() keep their alignment until they are
+ * resized, and the others have the alignment of nalloc().
+ *
+ * @param mem     pointer to allocated memory chunk.
+ * @param parent  pointer to allocated memory chunk from which the copy
+ *                depends, or NULL.
+ *
+ * @return pointer to the copy of mem, or NULL if there was an error.
+ */
+void *nalloc_clone(const void *mem, void *parent);
+
+/**
+ * Relocate the subtree rooted at a memory chunk into depth-first order, in a
+ * single block sized to hold it, once allocations and frees have scattered
+ * it. The subtree is copied like with nalloc_clone(), and the copy takes
+ * the place of the original among its siblings. Destructors move to the
+ * copies, and the original is then freed without running them. Pointers to
+ * the chunks of the subtree, and within them, are invalidated. The copy
+ * gets its block from the allocator of mem, on the NUMA node of its arena
+ * if it is carved, and when mem is the root of an arena tree, the limit and
+ * pressure callback of that arena (see nalloc_set_limit()). It does not keep
+ * the huge pages (see nalloc_arena_huge()) nor the block size of an arena.
+ *
+ * @param mem  pointer to allocated memory chunk, not in a compact arena
+ *             other than as its root.
+ *
+ * @return pointer to the new root of the subtree, or NULL if there was an
+ *         error, in which case the subtree is left untouched.
+ */
+void *nalloc_defrag(void *mem);
+
 /**
  * Modify the size of a memory chunk.
  *
@@ -67,6 +314,27 @@ void *ncalloc(size_t size, void *parent);
  */
 void *nrealloc(void *mem, size_t size);
 
+/**
+ * Modify the size of a memory chunk like nrealloc(), and make room for it
+ * to grow up to hint bytes without moving.
+ *
+ * With the system allocator and a C library that reports the usable size
+ * of its blocks (glibc), nrealloc() only moves a chunk once it outgrows its
+ * block, and then makes room for half of its size more when it grows by a
+ * small amount, so that a series of small grows mostly happens in place.
+ * nrealloc_reserve() moves the chunk to a large enough block up front. For
+ * other chunks, the hint is ignored.
+ *
+ * @param mem   pointer to allocated memory chunk, or NULL to allocate a new
+ *              chunk without a parent.
+ * @param min   amount of memory requested (in bytes).
+ * @param hint  amount of memory to make room for (in bytes).
+ *
+ * @return pointer to the allocated memory chunk.
+ * @return NULL if there was an error.
+ */
+void *nrealloc_reserve(void *mem, size_t min, size_t hint);
+
 /**
  * Deallocate a memory chunk and all the chunks depending on it.
  *
@@ -76,6 +344,52 @@ void *nrealloc(void *mem, size_t size);
  */
 void *nfree(void *mem);
 
+/**
+ * Detach a memory chunk from its parent, like nalloc_set_parent() with a
+ * NULL parent, and leave the deallocation of the chunk and all the chunks
+ * depending on it to nalloc_reclaim(). The chunks must not be used anymore.
+ * Compact chunks are freed right away, since that only detaches them.
+ *
+ * @param mem  pointer to allocated memory chunk.
+ *
+ * @return always NULL, can be safely ignored.
+ */
+void *nfree_deferred(void *mem);
+
+/**
+ * Deallocate the chunks handed to nfree_deferred() by any thread, for up
+ * to about budget_ns nanoseconds (the clock is checked every 64 chunks).
+ * A large tree is freed over as many calls as it takes. Calling it in a
+ * loop from a background thread gives a reclaimer thread, and calling it
+ * with a small budget from an event loop bounds the pause. Destructors run
+ * on the calling thread. Calls from several threads take turns.
+ *
+ * @param budget_ns  time budget (in nanoseconds), or 0 for no limit.
+ *
+ * @return 1 if some chunks are left to free, 0 otherwise.
+ */
+int nalloc_reclaim(size_t budget_ns);
+
+/**
+ * Deallocate a memory chunk and all the chunks depending on it, like
+ * nfree(), with up to nthreads threads (at most 64), counting the calling
+ * thread. The subtrees of the chunk are handed out to the threads as they
+ * go, splitting the top levels of the tree as needed to keep them all busy.
+ * Destructors still run child first, but on any of the threads, and
+ * concurrently with each other. The subtrees of arenas, compact chunks and
+ * chunks from a custom allocator are freed one at a time. Small chunks go
+ * back to the cache of the thread that allocated them.
+ *
+ * Starting the threads takes some tens of microseconds, which only pays off
+ * for large trees.
+ *
+ * @param mem       pointer to previously nalloc'ed memory chunk.
+ * @param nthreads  number of threads to free the tree with.
+ *
+ * @return always NULL, can be safely ignored.
+ */
+void *nfree_parallel(void *mem, unsigned nthreads);
+
 /**
  * Get the parent of a memory chunk (the chunk on which it depends).
  *
@@ -85,6 +399,44 @@ void *nfree(void *mem);
  */
 void *nalloc_get_parent(const void *mem);
 
+/**
+ * Get the first child of a memory chunk. Together with
+ * nalloc_next_sibling(), this iterates over the children of a chunk from
+ * the first to the last one (allocations insert chunks in front). Like
+ * nalloc_get_parent(), it only reads links.
+ *
+ * @param mem  pointer to allocated memory chunk.
+ *
+ * @return pointer to the first child of the chunk, or NULL if it has none.
+ */
+void *nalloc_first_child(const void *mem);
+
+/**
+ * Get the next sibling of a memory chunk, see nalloc_first_child().
+ *
+ * @param mem  pointer to allocated memory chunk.
+ *
+ * @return pointer to the next sibling of the chunk, or NULL if it is the
+ *         last child of its parent (or has no parent).
+ */
+void *nalloc_next_sibling(const void *mem);
+
+/**
+ * Visit the subtree rooted at a memory chunk, depth first, in constant
+ * stack space. pre is called with each chunk before its children, and post
+ * after them. While a chunk is visited, the headers of the next chunks of
+ * the walk are prefetched. The callbacks can change the contents of the
+ * chunks, but not the tree.
+ *
+ * @param mem   pointer to allocated memory chunk, or NULL.
+ * @param pre   called with each chunk and ctx before its children, or NULL.
+ *              Returning non-zero skips the children of the chunk.
+ * @param post  called with each chunk and ctx after its children, or NULL.
+ * @param ctx   passed to the callbacks.
+ */
+void nalloc_walk(void *mem, int (*pre)(void *mem, void *ctx),
+		 void (*post)(void *mem, void *ctx), void *ctx);
+
 /**
  * Change the parent of a memory chunk. This will affect the
  * dependencies of the entire subtree rooted at the given chunk.
@@ -95,6 +447,78 @@ void *nalloc_get_parent(const void *mem);
  */
 void nalloc_set_parent(void *mem, void *parent);
 
+/**
+ * Change the parent of a memory chunk like nalloc_set_parent(), but insert
+ * it after the last child of parent. nalloc_set_parent() and allocations
+ * insert chunks in front of the children of their parent.
+ *
+ * @param mem     pointer to allocated memory chunk.
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ */
+void nalloc_append(void *mem, void *parent);
+
+/**
+ * Make the chunks allocated below a memory chunk go after its last child
+ * instead of in front of its first one, so that iterating over the children
+ * follows allocation order. Chunks allocated below a chunk in this mode take
+ * the slow path, which costs a few nanoseconds more. The mode is kept by
+ * nalloc_clone() and nalloc_defrag().
+ *
+ * @param mem     pointer to allocated memory chunk.
+ * @param append  non-zero to allocate at the tail, 0 to allocate in front.
+ *
+ * @return 0 on success, -1 if there was an error.
+ */
+int nalloc_set_append(void *mem, int append);
+
+/**
+ * Get a mark of the children of a memory chunk, to free the ones allocated
+ * after it with nalloc_rollback(). The mark is the newest child, the first
+ * one or the last one depending on nalloc_set_append(), and stays valid as
+ * long as it is a child of the chunk and the mode is not changed.
+ *
+ * @param parent  pointer to allocated memory chunk.
+ *
+ * @return the mark, NULL if the chunk has no children.
+ */
+void *nalloc_mark(const void *parent);
+
+/**
+ * Free the children of a memory chunk that were allocated after a mark from
+ * nalloc_mark(), along with their descendants. This takes time proportional
+ * to what is freed. Carved chunks give their space back to their arena when
+ * freed in the reverse order they were carved in, so rolling back the latest
+ * allocations below an arena tree lets the next ones reuse it. A mark that
+ * is no longer valid, because it was freed or moved, is not a child of the
+ * chunk anymore: nothing is freed then, after looking through all of the
+ * children for it.
+ *
+ * @param parent  pointer to allocated memory chunk, or NULL.
+ * @param mark    mark from nalloc_mark() on parent.
+ *
+ * @return 0 on success, -1 if the mark is no longer valid or there was an
+ *         error.
+ */
+int nalloc_rollback(void *parent, const void *mark);
+
+/**
+ * Change the parent of a range of siblings, keeping their order, and insert
+ * them after the last child of parent like nalloc_append(). When both the
+ * old and the new parent are regular chunks, or chunks carved from the same
+ * arena, the range is spliced in constant time, relinking only its ends and,
+ * with NALLOC_PARENT, the parent link of each chunk of the range. Otherwise
+ * the chunks are moved one at a time.
+ *
+ * @param first   pointer to the first allocated memory chunk of the range.
+ * @param last    pointer to the last allocated memory chunk of the range, a
+ *                later sibling of first, or first itself.
+ * @param parent  pointer to allocated memory chunk from which the chunks of
+ *                the range will depend, or NULL. It must not belong to the
+ *                subtree of any of them.
+ */
+void nalloc_move_range(void *first, void *last, void *parent);
+
 /**
  * Remove a memory chunk from the dependency tree, taking care of its
  * children (they will depend on parent).
@@ -105,4 +529,264 @@ void nalloc_set_parent(void *mem, void *parent);
  */
 void nalloc_cut(void *mem, void *parent);
 
+/**
+ * Set a function to call on a memory chunk right before it is freed, with
+ * nfree() or along with one of its ancestors, or NULL to remove it. By then,
+ * all of the children of the chunk have been freed, so destructors run child
+ * first, within the walk that frees the tree. The destructor gets the chunk
+ * itself, and must neither use its links nor call nalloc functions on the
+ * tree being freed. Chunks without a destructor cost nothing more to free,
+ * but an arena tree with destructors is walked when freed instead of being
+ * released at once. Compact chunks can not have a destructor.
+ *
+ * @param mem         pointer to allocated memory chunk.
+ * @param destructor  function to call with mem, or NULL.
+ *
+ * @return 0 on success, -1 if there was an error.
+ */
+int nalloc_set_destructor(void *mem, void (*destructor)(void *mem));
+
+/**
+ * Limit the memory an arena gets from its allocator, so that allocations
+ * under its root fail fast once the limit is reached. The budget is checked
+ * when the arena needs a new block, so carving chunks costs nothing more,
+ * and it covers the blocks of the arena, its own first block included. Close
+ * to the limit, smaller blocks are used as long as the allocation fits.
+ * It also covers the memory of the arena trees (clones included), compact
+ * regions and aligned chunks that depend on a carved chunk of the arena,
+ * for as long as they do: they count towards the nearest arena they are
+ * nested in, and through it towards the arenas that one is nested in, so
+ * creating or growing them under a limited arena fails the same way.
+ * Before failing, the pressure callback gets the root, the bytes counted
+ * towards the arena and the size of the memory that does not fit, and
+ * the allocation only goes ahead if it raises the limit with another call
+ * to nalloc_set_limit(). Freeing carved chunks does not lower the count,
+ * since blocks are only given back when the arena is freed, even though the
+ * space of the chunks carved last is reused once they are freed. Regular
+ * chunks moved below a carved chunk of the arena, and whatever depends on
+ * them, are not counted.
+ *
+ * @param root      pointer to the root of an arena tree, from nalloc_arena()
+ *                  or nalloc_clone().
+ * @param bytes     maximum size of the arena blocks (in bytes), 0 for none.
+ * @param pressure  function to call when the limit would be exceeded, or
+ *                  NULL to fail right away.
+ *
+ * @return 0 on success, -1 if root is not the root of an arena tree.
+ */
+int nalloc_set_limit(void *root, size_t bytes,
+		     void (*pressure)(void *root, size_t used, size_t size));
+
+/**
+ * Statistics about a subtree, see nalloc_subtree_stats().
+ */
+struct nalloc_stats {
+	size_t nodes;  /**< Number of chunks, the root of the subtree included. */
+	size_t bytes;  /**< Total size of those chunks (in bytes). */
+	size_t depth;  /**< Depth of the deepest chunk below the root. */
+	size_t fanout; /**< Largest number of children of a chunk. */
+};
+
+/**
+ * Gather the statistics of the subtree rooted at a memory chunk. The sizes
+ * are the ones requested for the chunks, without headers nor padding.
+ *
+ * @param mem    pointer to allocated memory chunk, or NULL.
+ * @param stats  filled with the statistics of the subtree.
+ */
+void nalloc_subtree_stats(const void *mem, struct nalloc_stats *stats);
+
+/**
+ * Allocate a (contiguous) memory chunk, like nalloc(), and record an
+ * allocation site for it, such as the name of a subsystem, that
+ * nalloc_dump_profile() sums its subtree up by. The site is only recorded
+ * when nalloc is built with NALLOC_PROFILE, which adds a word to the header
+ * of the chunks, and compact chunks never have one. nalloc_here() records
+ * the file and line it is called from.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ * @param tag     allocation site, a string that must outlive the chunk.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_tagged(size_t size, void *parent, const char *tag);
+
+#define NALLOC_STR_(x) #x
+#define NALLOC_STR(x) NALLOC_STR_(x)
+#define NALLOC_SITE __FILE__ ":" NALLOC_STR(__LINE__)
+#define nalloc_here(size, parent) nalloc_tagged(size, parent, NALLOC_SITE)
+
+/**
+ * Write a heap profile of the subtree rooted at a memory chunk, in the
+ * folded format of flamegraph.pl. Each chunk belongs to the stack of the
+ * allocation sites recorded on the way down to it (see nalloc_tagged()), in
+ * which a chunk without a site takes the one of its parent. Each line gives
+ * a stack, its sites separated by ';', with a last frame holding the number
+ * of chunks, then their size:
+ * @code
+ *   untagged;[1 chunks] 64
+ *   parser;[1200 chunks] 38400
+ *   parser;cache.c:42;[10 chunks] 4096
+ * @endcode
+ * The sizes are the ones requested for the chunks, without headers nor
+ * padding.
+ *
+ * @param mem  pointer to allocated memory chunk.
+ * @param fp   stream to write the profile to.
+ *
+ * @return 0 on success, -1 if there was an error.
+ */
+int nalloc_dump_profile(const void *mem, FILE *fp);
+
+/**
+ * Write a copy of the subtree rooted at a memory chunk into a buffer, as a
+ * snapshot that nalloc_snapshot_map() can map back from a file. The links
+ * of the copy are rewritten as offsets, and the content of the chunks is
+ * copied as is, so pointers stored in it are not relocated. Every chunk of
+ * the snapshot can be at most 1 MiB large, the whole snapshot at most 4 GiB,
+ * and the copies are aligned to 16 bytes. Only available on 64-bit targets.
+ *
+ * @param mem   pointer to allocated memory chunk.
+ * @param buf   buffer receiving the snapshot, or NULL.
+ * @param size  size of the buffer (in bytes).
+ *
+ * @return the size of the snapshot (in bytes), that is only written if it
+ *         fits in the buffer, or 0 if the subtree does not fit in one.
+ */
+size_t nalloc_snapshot(const void *mem, void *buf, size_t size);
+
+/**
+ * Map a snapshot written by nalloc_snapshot() from a file, read-only and
+ * shared, so that its pages are loaded on demand and shared between the
+ * processes mapping it. The mapped chunks can only be read and navigated,
+ * with nalloc_get_parent() or nalloc_subtree_stats(); nfree() of the root
+ * unmaps the snapshot, and does nothing on other chunks. Allocating below
+ * them, nrealloc() and nalloc_defrag() fail and return NULL, and
+ * nalloc_rollback() fails without freeing anything. They can not be reparented or cut, and
+ * other chunks can not be moved below them: like moves out of a compact
+ * arena (see nalloc_compact()), these are refused, with an assertion
+ * failure in debug builds. Only available on 64-bit targets.
+ *
+ * @param fd  file descriptor of the snapshot, opened for reading.
+ *
+ * @return pointer to the root of the snapshot, or NULL if there was an
+ *         error.
+ */
+void *nalloc_snapshot_map(int fd);
+
+/**
+ * Operation counters, see nalloc_counters().
+ */
+struct nalloc_counters {
+	size_t allocs;       /**< Chunks allocated. */
+	size_t frees;        /**< Chunks freed, with their subtree. */
+	size_t moves;        /**< Reallocations that moved the chunk. */
+	size_t reparents;    /**< Reparenting calls. */
+	size_t lookups;      /**< Calls to nalloc_get_parent(). */
+	size_t lookup_steps; /**< Siblings walked by nalloc_get_parent(). */
+	size_t cuts;         /**< Calls to nalloc_cut(). */
+	size_t cut_steps;    /**< Children moved one by one by nalloc_cut(). */
+	size_t bytes;        /**< Size of the live chunks (in bytes). */
+};
+
+/**
+ * Add up the operation counters of all threads, past and present. Counting
+ * is only done when nalloc is built with NALLOC_STATS; the counters are all
+ * zero otherwise.
+ *
+ * @param counters  filled with the sums of the counters.
+ */
+void nalloc_counters(struct nalloc_counters *counters);
+
+/**
+ * Install hooks called on every allocation and free, or NULL to remove
+ * them. They are only called when nalloc is built with NALLOC_STATS.
+ *
+ * on_alloc is called with each new chunk once it is linked to its parent,
+ * and on_free with each chunk of a subtree about to be freed. nrealloc()
+ * calls on_free with the old chunk, which may no longer be accessible, then
+ * on_alloc with the new one. The hooks can be called concurrently from any
+ * thread, and must not call nalloc functions.
+ *
+ * @param on_alloc  called with each allocated chunk and its size, or NULL.
+ * @param on_free   called with each chunk being freed, or NULL.
+ */
+void nalloc_hooks(void (*on_alloc)(void *mem, size_t size),
+		  void (*on_free)(void *mem));
+
+/**
+ * A backing allocator, see nalloc_set_allocator(). Each function gets the
+ * ctx pointer of the allocator as its first argument. malloc, realloc and
+ * free behave as their standard counterparts; memalign returns a block of
+ * memory aligned to align (a power of two), which is released with free. A
+ * NULL calloc is replaced by malloc and memset.
+ */
+struct nalloc_allocator {
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*calloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *mem, size_t size);
+	void *(*memalign)(void *ctx, size_t align, size_t size);
+	void (*free)(void *ctx, void *mem);
+	void *ctx;
+};
+
+/**
+ * Set the allocator used for the chunks allocated without a parent, and
+ * the chunks below them. By default, chunks come from the system allocator
+ * through the chunk cache; chunks from another allocator bypass the cache.
+ *
+ * Chunks allocated below a chunk use the allocator of their parent, so a
+ * tree keeps its allocator when the default changes. Arena blocks and
+ * aligned chunks come from the same allocator as well; compact regions are
+ * always mapped from the system. A chunk moved to another tree is still
+ * released to the allocator it came from. At most 63 allocators can be used
+ * over the lifetime of a process, and each one must stay valid as long as
+ * chunks allocated from it are alive. Thread safe.
+ *
+ * @param ops  allocator, or NULL for the system allocator.
+ *
+ * @return 0 on success, -1 if ops is incomplete or too many allocators are
+ *         in use.
+ */
+int nalloc_set_allocator(const struct nalloc_allocator *ops);
+
+/**
+ * Allocate a (contiguous) memory chunk from a given allocator, instead of
+ * the one of its parent or the default one. The chunks allocated below it
+ * use the same allocator, see nalloc_set_allocator(). Below a carved or
+ * compact chunk, the chunk is carved as usual.
+ *
+ * @param size    amount of memory requested (in bytes).
+ * @param parent  pointer to allocated memory chunk from which this
+ *                chunk depends, or NULL.
+ * @param ops     allocator, or NULL for the system allocator.
+ *
+ * @return pointer to the allocated memory chunk, or NULL if there was an error.
+ */
+void *nalloc_with(size_t size, void *parent,
+		  const struct nalloc_allocator *ops);
+
+/**
+ * Set the maximum amount of memory kept in the chunk cache. Small chunks
+ * are not given back to the system allocator when freed, but kept to be
+ * reused by later allocations of a similar size, up to this limit. On top
+ * of it, each thread keeps a few chunks of each size for itself, and gets
+ * back the ones it allocated that are freed by other threads.
+ *
+ * @param bytes  cache size limit (in bytes), or 0 to disable the cache.
+ */
+void nalloc_cache_limit(size_t bytes);
+
+/**
+ * Give all the memory kept in the chunk cache, and in the cache of the
+ * calling thread, back to the system allocator.
+ */
+void nalloc_cache_trim(void);
+
+#ifdef NALLOC_INLINE
+#include "nalloc_inline.h"
+#endif
+
 #endif /* __NALLOC_H__ */
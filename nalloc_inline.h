@@ -0,0 +1,241 @@
+/**
+ * \brief Inline fast paths of nalloc(), nfree() and nalloc_get_parent().
+ *
+ * This header is included by nalloc.h when NALLOC_INLINE is defined, see
+ * there, and by nalloc.c, which checks that the layout described here is
+ * the one it uses. Everything it defines is prefixed with nalloc__ and is
+ * not part of the interface: only the three functions above are.
+ *
+ * The fast paths allocate a small regular chunk below a regular parent
+ * from the magazines of the calling thread, free a small childless chunk
+ * to them, and read the links of a regular chunk to find its parent. The
+ * other cases call the functions of the library, as do the ones of a
+ * program built with NALLOC_STATS or NALLOC_HARDEN, which have no fast
+ * path.
+ */
+
+#ifndef __NALLOC_INLINE_H__
+#define __NALLOC_INLINE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/* Chunk header layout, see nalloc.c. */
+#ifdef NALLOC_PARENT
+#define NALLOC__LINKS 4
+#else
+#define NALLOC__LINKS 3
+#endif
+
+#ifdef NALLOC_PROFILE
+#define NALLOC__SITES 1
+#else
+#define NALLOC__SITES 0
+#endif
+
+#if NALLOC_HARDEN
+#define NALLOC__WORDS (NALLOC__LINKS + NALLOC__SITES + 1)
+#else
+#define NALLOC__WORDS (NALLOC__LINKS + NALLOC__SITES)
+#endif
+
+#define NALLOC__INFO_SIZE (sizeof(uint32_t) * 2)
+#define NALLOC__HEADER_SIZE (sizeof(void *) * NALLOC__WORDS + NALLOC__INFO_SIZE)
+
+#define nalloc__link(mem, i) \
+	(((void **)((char *)(mem) - NALLOC__INFO_SIZE))[-(i)])
+#define nalloc__size_lo(mem) (((uint32_t *)(mem))[-2])
+#define nalloc__meta(mem) (((uint32_t *)(mem))[-1])
+
+#define NALLOC__LAST_TAG ((uintptr_t)1)
+#define nalloc__untag(mem) ((void *)((uintptr_t)(mem) & ~NALLOC__LAST_TAG))
+#define nalloc__is_last(mem) \
+	((uintptr_t)nalloc__link(mem, 2) & NALLOC__LAST_TAG)
+
+#define NALLOC__COMPACT (1u << 24)
+/* Flags of a parent that nalloc() has to take the slow path for. */
+#define NALLOC__SLOW_PARENT (1u << 20 | 1u << 24 | 1u << 25 | 1u << 27 | \
+			     1u << 30)
+/* The meta bits a chunk freed on the fast path may have: its aux field. */
+#define NALLOC__PLAIN 0x000fff00u
+
+/* Thread caches, see nalloc.c. */
+#define NALLOC__CACHE_GRAIN 16
+#define NALLOC__CACHE_CLASSES 32
+#define NALLOC__CACHE_MAX (NALLOC__CACHE_GRAIN * NALLOC__CACHE_CLASSES)
+#define NALLOC__MAG_SIZE 32
+
+struct nalloc__tcache {
+	unsigned id;
+	_Bool used;
+	void *_Atomic remote;
+	unsigned count[NALLOC__CACHE_CLASSES];
+	void *mag[NALLOC__CACHE_CLASSES][NALLOC__MAG_SIZE];
+};
+
+extern _Thread_local struct nalloc__tcache *nalloc__self;
+
+/*
+ * The library defines a symbol named after the options it is built with,
+ * that the fast paths refer to, so that a program built with other ones
+ * fails to link instead of corrupting the chunk headers.
+ */
+#ifdef NALLOC_PARENT
+#define NALLOC__ABI_PARENT p1
+#else
+#define NALLOC__ABI_PARENT p0
+#endif
+
+#ifdef NALLOC_STATS
+#define NALLOC__ABI_STATS s1
+#else
+#define NALLOC__ABI_STATS s0
+#endif
+
+#if NALLOC_HARDEN >= 3
+#define NALLOC__ABI_HARDEN h3
+#elif NALLOC_HARDEN == 2
+#define NALLOC__ABI_HARDEN h2
+#elif NALLOC_HARDEN
+#define NALLOC__ABI_HARDEN h1
+#else
+#define NALLOC__ABI_HARDEN h0
+#endif
+
+#ifdef NALLOC_PROFILE
+#define NALLOC__ABI_PROFILE t1
+#else
+#define NALLOC__ABI_PROFILE t0
+#endif
+
+#define NALLOC__CAT(p, s, h, t) nalloc__abi_##p##s##h##t
+#define NALLOC__NAME(p, s, h, t) NALLOC__CAT(p, s, h, t)
+#define NALLOC__ABI                                               \
+	NALLOC__NAME(NALLOC__ABI_PARENT, NALLOC__ABI_STATS,      \
+		     NALLOC__ABI_HARDEN, NALLOC__ABI_PROFILE)
+
+extern const char NALLOC__ABI;
+
+#if defined(NALLOC_INLINE) && !defined(NALLOC_STATS) && !NALLOC_HARDEN
+
+#ifdef __GNUC__
+#define nalloc__unlikely(x) __builtin_expect(!!(x), 0)
+static const char *const nalloc__abi __attribute__((used)) = &NALLOC__ABI;
+#else
+#define nalloc__unlikely(x) (x)
+static const char *const nalloc__abi = &NALLOC__ABI;
+#endif
+
+static inline void *nalloc__alloc(size_t size, void *parent)
+{
+	struct nalloc__tcache *t = nalloc__self;
+	unsigned class;
+	void *mem, *first;
+
+	if (nalloc__unlikely(!t || !parent ||
+			     size > NALLOC__CACHE_MAX - NALLOC__HEADER_SIZE ||
+			     (nalloc__meta(parent) & NALLOC__SLOW_PARENT)))
+		return nalloc(size, parent);
+
+	class = (unsigned)((size + NALLOC__HEADER_SIZE - 1) /
+			   NALLOC__CACHE_GRAIN);
+	if (nalloc__unlikely(!t->count[class]))
+		return nalloc(size, parent);
+
+	mem = t->mag[class][--t->count[class]];
+	memset(mem, 0, NALLOC__HEADER_SIZE);
+	mem = (char *)mem + NALLOC__HEADER_SIZE;
+	nalloc__size_lo(mem) = (uint32_t)size;
+	nalloc__meta(mem) = t->id << 8;
+
+	/* Link it in front of its siblings. */
+#ifdef NALLOC_PARENT
+	nalloc__link(mem, 4) = parent;
+#endif
+	if (!(first = nalloc__link(parent, 3))) {
+		nalloc__link(mem, 2) =
+			(void *)((uintptr_t)parent | NALLOC__LAST_TAG);
+		nalloc__link(mem, 1) = mem;
+	} else {
+		nalloc__link(mem, 2) = first;
+		nalloc__link(mem, 1) = nalloc__link(first, 1);
+		nalloc__link(first, 1) = mem;
+	}
+	nalloc__link(parent, 3) = mem;
+
+	return mem;
+}
+
+static inline void *nalloc__free(void *mem)
+{
+	struct nalloc__tcache *t = nalloc__self;
+	void *prev, *next;
+	unsigned class;
+
+	if (nalloc__unlikely(!t || !mem || nalloc__link(mem, 3) ||
+			     (nalloc__meta(mem) & ~NALLOC__PLAIN) ||
+			     nalloc__meta(mem) >> 8 != t->id ||
+			     nalloc__size_lo(mem) >
+				     NALLOC__CACHE_MAX - NALLOC__HEADER_SIZE))
+		return nfree(mem);
+
+	class = (unsigned)((nalloc__size_lo(mem) + NALLOC__HEADER_SIZE - 1) /
+			   NALLOC__CACHE_GRAIN);
+	if (nalloc__unlikely(t->count[class] == NALLOC__MAG_SIZE))
+		return nfree(mem);
+
+	/* Unlink it from its parent and siblings, as nfree() does. */
+	if ((prev = nalloc__link(mem, 1))) {
+		next = nalloc__link(mem, 2);
+
+		if (prev == mem)
+			nalloc__link(nalloc__untag(next), 3) = NULL;
+		else {
+			if (nalloc__is_last(prev))
+				nalloc__link(nalloc__untag(nalloc__link(prev, 2)),
+					     3) = next;
+			else
+				nalloc__link(prev, 2) = next;
+
+			if (nalloc__is_last(mem))
+				nalloc__link(nalloc__link(nalloc__untag(next),
+							  3), 1) = prev;
+			else
+				nalloc__link(next, 1) = prev;
+		}
+	}
+
+	t->mag[class][t->count[class]++] = (char *)mem - NALLOC__HEADER_SIZE;
+	return NULL;
+}
+
+static inline void *nalloc__get_parent(const void *mem)
+{
+	if (nalloc__unlikely(!mem || (nalloc__meta(mem) & NALLOC__COMPACT)))
+		return nalloc_get_parent(mem);
+
+	/* A root has no prev link. */
+	if (!nalloc__link(mem, 1))
+		return NULL;
+
+#ifdef NALLOC_PARENT
+	return nalloc__link(mem, 4);
+#else
+	/* The last sibling is next to the first one. */
+	if (nalloc__is_last(nalloc__link(mem, 1)))
+		mem = nalloc__link(mem, 1);
+
+	while (!nalloc__is_last(mem))
+		mem = nalloc__link(mem, 2);
+
+	return nalloc__untag(nalloc__link(mem, 2));
+#endif
+}
+
+#define nalloc(size, parent) nalloc__alloc(size, parent)
+#define nfree(mem) nalloc__free(mem)
+#define nalloc_get_parent(mem) nalloc__get_parent(mem)
+
+#endif /* NALLOC_INLINE */
+
+#endif /* __NALLOC_INLINE_H__ */
@@ -1,3 +1,15 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "nalloc.h"
 
 struct matrix { size_t rows, cols; int **data; };
@@ -14,9 +26,1375 @@ struct matrix *matrix_new(size_t rows, size_t cols)
  
 void matrix_delete(struct matrix *m) { nfree(m); }
 
+static void test_links(void)
+{
+    void *root = nalloc(16, NULL), *a = nalloc(16, root), *b = nalloc(16, root);
+    void *c = nalloc(16, b), *d = nalloc(16, b), *other = nalloc(16, NULL);
+
+    assert(nalloc_get_parent(a) == root && nalloc_get_parent(d) == b);
+
+    b = nrealloc(b, 4096);
+    assert(nalloc_get_parent(b) == root);
+    assert(nalloc_get_parent(c) == b && nalloc_get_parent(d) == b);
+
+    nalloc_set_parent(a, b);
+    assert(nalloc_get_parent(a) == b && nalloc_get_parent(c) == b);
+
+    nalloc_cut(b, other);
+    assert(!nalloc_get_parent(b) && nalloc_get_parent(a) == other);
+    assert(nalloc_get_parent(c) == other && nalloc_get_parent(d) == other);
+
+    /* Appended chunks keep their order through cuts. */
+    nalloc_append(a, b);
+    nalloc_append(c, b);
+    nalloc_append(d, b);
+    nalloc_cut(b, root);
+    assert(nalloc_get_parent(a) == root && nalloc_get_parent(d) == root);
+    nalloc_cut(root, NULL);
+    assert(!nalloc_get_parent(a) && !nalloc_get_parent(c));
+
+    nfree(a);
+    nfree(c);
+    nfree(d);
+    nfree(b);
+    nfree(root);
+    nfree(other);
+}
+
+/* Trees this wide or deep would overflow the stack with a recursive nfree. */
+static void test_free_large_trees(void)
+{
+    void *root = nalloc(16, NULL), *mem = root;
+    for (int i = 0; i < 500000; i++)
+        nalloc(16, root);
+    for (int i = 0; i < 500000; i++)
+        mem = nalloc(16, mem);
+    nfree(root);
+}
+
+static void test_realloc(void)
+{
+    void *root = nalloc(16, NULL), *child;
+    char *buf = nalloc(0, root), *last;
+    size_t moves = 0;
+
+    child = nalloc(16, buf);
+    for (size_t i = 0; i < 100000; i++) {
+        last = buf;
+        buf = nrealloc(buf, i + 1);
+        moves += buf != last;
+        buf[i] = (char)i;
+    }
+
+    for (size_t i = 0; i < 100000; i++)
+        assert(buf[i] == (char)i);
+    assert(nalloc_get_parent(buf) == root);
+    assert(nalloc_get_parent(child) == buf);
+
+    buf = nrealloc_reserve(buf, 10, 1 << 20);
+    assert(buf && buf[9] == 9);
+    for (size_t size = 10; size <= 1 << 20; size += 4096) {
+        last = buf;
+        buf = nrealloc(buf, size);
+#ifdef __GLIBC__
+        assert(buf == last);
+#endif
+    }
+#ifdef __GLIBC__
+    assert(moves < 100);
+#endif
+    (void)moves;
+
+    buf = nrealloc_reserve(NULL, 0, 1000);
+    assert(buf && !nalloc_get_parent(buf));
+    nfree(buf);
+    nfree(root);
+}
+
+static void test_arena(void)
+{
+    void *arena = nalloc_arena(0, NULL, 4096);
+    void *outside = nalloc(16, NULL);
+    char *buf = nalloc(8, arena), *big;
+
+    for (int i = 0; i < 10000; i++)
+        nalloc(24, buf);
+
+    strcpy(buf, "arena");
+    buf = nrealloc(buf, 100000);
+    assert(!strcmp(buf, "arena"));
+    assert(nalloc_get_parent(buf) == arena);
+
+    /* Carved chunks outlive the arena once moved out of it. */
+    big = ncalloc(8192, buf);
+    nalloc_set_parent(big, outside);
+    nalloc_set_parent(nalloc(16, NULL), arena);
+    nfree(arena);
+
+    assert(!big[8191]);
+    nalloc(16, big);
+    nfree(outside);
+}
+
+static void test_numa(void)
+{
+    void *root = nalloc_arena_on_node(16, NULL, 4096, 0), *local, *mem = root;
+
+    assert(root);
+    for (int i = 0; i < 10000; i++)
+        mem = nalloc(24, mem);
+    assert(nalloc_arena(16, mem, 0) && nalloc_clone(mem, root));
+    assert(nrealloc(mem, 100000));
+
+    local = nalloc_arena_on_node(16, root, 0, -1);
+    assert(local && nalloc_get_parent(local) == root);
+    assert(!nalloc_arena_on_node(16, NULL, 0, 1 << 20));
+    nfree(root);
+}
+
+static void test_huge(void)
+{
+    void *root = nalloc_arena_huge(16, NULL, 0), *mem = root, *big;
+
+    assert(root);
+    for (int i = 0; i < 100000; i++)
+        mem = nalloc(24, mem);
+    big = ncalloc(3 << 20, root);
+    assert(big && !((char *)big)[(3 << 20) - 1]);
+    assert(nalloc_set_limit(root, 8 << 20, NULL) == 0);
+    assert(!nalloc(3 << 20, root));
+    nalloc_set_parent(nalloc(16, NULL), mem);
+    nfree(root);
+}
+
+static void test_compact(void)
+{
+    void *outside = nalloc(16, NULL);
+    void *root = nalloc_compact(8, outside), *a, *b, *c;
+    char *buf;
+
+    assert(root && nalloc_get_parent(root) == outside);
+
+    a = nalloc(16, root);
+    b = ncalloc(16, root);
+    c = nalloc(16, a);
+    assert(nalloc_get_parent(a) == root && nalloc_get_parent(b) == root);
+    assert(nalloc_get_parent(c) == a);
+
+    for (int i = 0; i < 100000; i++)
+        nalloc(16, b);
+
+    buf = nalloc(8, a);
+    strcpy(buf, "compact");
+    buf = nrealloc(buf, 100000);
+    assert(!strcmp(buf, "compact"));
+    assert(nalloc_get_parent(buf) == a);
+
+    /* The root is a regular chunk, its children follow it when it moves. */
+    root = nrealloc(root, 4096);
+    assert(nalloc_get_parent(a) == root && nalloc_get_parent(root) == outside);
+
+    nalloc_append(c, b);
+    assert(nalloc_get_parent(c) == b);
+    nalloc_cut(b, a);
+    assert(nalloc_get_parent(c) == a);
+    nfree(b);
+
+    /* Chunks of other regions and regular chunks can not be mixed in. */
+    assert(!nalloc_arena(16, a, 0) && !nalloc_compact(16, a));
+
+    nfree(outside);
+}
+
+static void test_aligned(void)
+{
+    void *root = nalloc(16, NULL), *arena = nalloc_arena(0, root, 0);
+    char *mem;
+
+    for (size_t align = 1; align <= 8192; align *= 2) {
+        mem = nalloc_aligned(100, align, root);
+        assert(mem && !((uintptr_t)mem % align));
+        assert(nalloc_get_parent(mem) == root);
+
+        strcpy(mem, "aligned");
+        mem = nrealloc(mem, 10000);
+        assert(mem && !((uintptr_t)mem % align));
+        assert(!strcmp(mem, "aligned"));
+        mem = nrealloc(mem, 10);
+        assert(mem && !((uintptr_t)mem % align));
+        assert(!strcmp(mem, "aligned"));
+
+        mem = ncalloc_aligned(4096, align, arena);
+        assert(mem && !((uintptr_t)mem % align) && !mem[4095]);
+        nalloc(16, mem);
+    }
+
+    assert(!nalloc_aligned(16, 24, root) && !nalloc_aligned(16, 0, root));
+    nfree(root);
+}
+
+static void test_array(void)
+{
+    void *root = nalloc(16, NULL), *other = nalloc(16, NULL), *rows[1000];
+    void *first = nalloc(16, root), *arena, *compact;
+    char *row;
+
+    assert(nalloc_array(1000, 24, root, rows) == rows);
+    for (int i = 0; i < 1000; i++) {
+        assert(nalloc_get_parent(rows[i]) == root);
+        memset(rows[i], i, 24);
+    }
+
+    /* They come in order, in front of the other children. */
+    nalloc_cut(rows[0], NULL);
+    assert(!nalloc_get_parent(rows[0]));
+    nalloc_set_parent(rows[0], root);
+    nalloc_cut(root, other);
+    assert(nalloc_get_parent(first) == other);
+    nalloc_set_parent(root, NULL);
+
+    row = nrealloc(rows[500], 100000);
+    assert(row[23] == (char)500);
+    nalloc(16, rows[999]);
+
+    /* An element outlives the others once moved out. */
+    nalloc_set_parent(rows[1], NULL);
+    nfree(other);
+    assert(((char *)rows[1])[23] == 1);
+    nfree(rows[1]);
+
+    assert(nalloc_array(10, 16, NULL, rows) == rows);
+    for (int i = 0; i < 10; i++)
+        nfree(rows[i]);
+
+    arena = nalloc_arena(0, root, 0);
+    compact = nalloc_compact(0, root);
+    assert(nalloc_array(10, 16, arena, rows) == rows);
+    assert(nalloc_get_parent(rows[9]) == arena);
+    assert(nalloc_array(10, 16, compact, rows) == rows);
+    assert(nalloc_get_parent(rows[0]) == compact);
+    assert(nalloc_array(0, 16, root, rows) == rows);
+    nfree(root);
+}
+
+static void *destroyed[2048];
+static size_t ndestroyed;
+
+static void destroy(void *mem)
+{
+    destroyed[ndestroyed++] = mem;
+}
+
+static void test_destructor(void)
+{
+    void *root = nalloc(16, NULL), *a = nalloc(16, root), *b, *c, *arena;
+
+    b = nalloc(16, a);
+    c = nalloc(16, a);
+    assert(!nalloc_set_destructor(root, destroy));
+    assert(!nalloc_set_destructor(a, destroy));
+    assert(!nalloc_set_destructor(b, destroy));
+    assert(!nalloc_set_destructor(c, destroy));
+    assert(!nalloc_set_destructor(c, NULL));
+    b = nrealloc(b, 100000);
+
+    /* Carved chunks with a destructor force a walk of their arena. */
+    arena = nalloc_arena(16, root, 0);
+    for (size_t i = 0; i < 1000; i++)
+        assert(!nalloc_set_destructor(nalloc(16, nalloc(16, arena)), destroy));
+
+    nfree(root);
+    assert(ndestroyed == 1003);
+    assert(destroyed[1000] == b && destroyed[1001] == a);
+    assert(destroyed[1002] == root);
+
+    root = nalloc_compact(16, NULL);
+    assert(nalloc_set_destructor(nalloc(16, root), destroy) == -1);
+    assert(!nalloc_set_destructor(root, destroy));
+    nfree(root);
+    assert(ndestroyed == 1004 && destroyed[1003] == root);
+}
+
+static void test_deferred(void)
+{
+    void *root = nalloc(16, NULL), *mem = root, *arena, *region;
+    size_t calls = 0;
+
+    for (int i = 0; i < 100000; i++)
+        mem = nalloc(16, mem);
+    ndestroyed = 0;
+    assert(!nalloc_set_destructor(mem, destroy));
+    arena = nalloc_arena(16, NULL, 0);
+    nalloc(16, arena);
+
+    nfree_deferred(root);
+    nfree_deferred(arena);
+    region = nalloc_compact(16, NULL);
+    nfree_deferred(nalloc(16, region));
+    nfree_deferred(region);
+    assert(!ndestroyed);
+
+    while (nalloc_reclaim(1000))
+        calls++;
+    assert(calls > 1 && ndestroyed == 1 && destroyed[0] == mem);
+    assert(!nalloc_reclaim(0));
+}
+
+/* Whether a function aborts, when run in a child process. */
+static int aborts(void (*fn)(void))
+{
+    pid_t pid = fork();
+    int status;
+
+    if (!pid) {
+        freopen("/dev/null", "w", stderr);
+        fn();
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+/* The mapped snapshot the functions below try to change. */
+static char *snapshot;
+
+static void move_snapshot(void)
+{
+    nalloc_set_parent(nalloc_first_child(snapshot), nalloc(16, NULL));
+}
+
+static void move_below_snapshot(void)
+{
+    nalloc_set_parent(nalloc(16, NULL), snapshot);
+}
+
+static void cut_snapshot(void)
+{
+    nalloc_cut(snapshot, NULL);
+}
+
+static void cut_below_snapshot(void)
+{
+    void *mem = nalloc(16, NULL);
+
+    nalloc(16, mem);
+    nalloc_cut(mem, snapshot);
+}
+
+static void test_snapshot(void)
+{
+    char *root = nalloc(10, NULL), *mem = root, *buf, *copy;
+    struct nalloc_stats stats, copy_stats;
+    size_t size;
+    FILE *file = tmpfile();
+
+    strcpy(root, "snapshot");
+    for (int i = 0; i < 1000; i++)
+        mem = nalloc(1, mem);
+    for (int i = 0; i < 100; i++)
+        nalloc(20, nalloc(2, root));
+    nalloc(3, nalloc(3, nalloc_compact(4, mem)));
+    nalloc(5, nalloc_arena(5, root, 0));
+
+    size = nalloc_snapshot(root, NULL, 0);
+    assert(size && nalloc_snapshot(root, NULL, size - 1) == size);
+    buf = malloc(size);
+    assert(nalloc_snapshot(root, buf, size) == size);
+    assert(fwrite(buf, 1, size, file) == size && !fflush(file));
+    free(buf);
+
+    copy = nalloc_snapshot_map(fileno(file));
+    assert(copy && !strcmp(copy, "snapshot") && !nalloc_get_parent(copy));
+    nalloc_subtree_stats(root, &stats);
+    nalloc_subtree_stats(copy, &copy_stats);
+    assert(!memcmp(&stats, &copy_stats, sizeof(stats)));
+
+    /* Snapshots are read-only. */
+    assert(!nalloc(8, copy) && !ncalloc(8, copy) && !nrealloc(copy, 100));
+    assert(!nalloc_defrag(copy) && nalloc_set_append(copy, 1) == -1);
+    assert(nalloc_rollback(copy, NULL) == -1);
+    assert(!strcmp(copy, "snapshot") && nalloc_first_child(copy));
+    snapshot = copy;
+    assert(aborts(move_snapshot) && aborts(move_below_snapshot));
+    assert(aborts(cut_snapshot) && aborts(cut_below_snapshot));
+    nfree(copy);
+    fclose(file);
+
+    nrealloc(mem, 2 << 20);
+    assert(!nalloc_snapshot(root, NULL, 0));
+    nfree(root);
+}
+
+static void test_clone(void)
+{
+    char *root = nalloc(10, NULL), *mem = root, *copy, *other;
+    struct nalloc_stats stats, copy_stats;
+
+    strcpy(root, "clone");
+    for (int i = 0; i < 1000; i++)
+        mem = nalloc(1, mem);
+    for (int i = 0; i < 100; i++)
+        nalloc(20, nalloc(2, root));
+    nalloc(3, nalloc(3, nalloc_compact(4, mem)));
+    nalloc(5, nalloc_arena(5, root, 0));
+    other = nalloc(16, NULL);
+
+    copy = nalloc_clone(root, other);
+    assert(copy && !strcmp(copy, "clone"));
+    assert(nalloc_get_parent(copy) == other);
+    nalloc_subtree_stats(root, &stats);
+    nalloc_subtree_stats(copy, &copy_stats);
+    assert(!memcmp(&stats, &copy_stats, sizeof(stats)));
+
+    /* The copy is a regular arena tree. */
+    mem = nrealloc(nalloc(10, copy), 100000);
+    nalloc_set_parent(mem, root);
+    nfree(nalloc_clone(copy, NULL));
+    nfree(other);
+    assert(!nalloc_clone(root, nalloc_compact(0, root)));
+    nfree(root);
+}
+
+enum root_kind { ROOT_REGULAR, ROOT_ARENA, ROOT_COMPACT };
+
+/* Run a test below a root of each kind, freeing the roots afterwards. */
+static void with_each_root(void (*test)(void *root, enum root_kind kind))
+{
+    void *roots[] = { nalloc(8, NULL), nalloc_arena(8, NULL, 0),
+                      nalloc_compact(8, NULL) };
+
+    for (int kind = ROOT_REGULAR; kind <= ROOT_COMPACT; kind++) {
+        test(roots[kind], kind);
+        nfree(roots[kind]);
+    }
+}
+
+static void append_below(void *root, enum root_kind kind)
+{
+    void *child[3], *array[4];
+
+    assert(nalloc_set_append(root, 1) == 0);
+    child[0] = nalloc(8, root);
+    child[1] = ncalloc(8, root);
+    child[2] = kind == ROOT_COMPACT ? nalloc(8, root)
+                                    : nalloc_aligned(8, 64, root);
+    assert(nalloc_first_child(root) == child[0]);
+    assert(nalloc_next_sibling(child[0]) == child[1]);
+    assert(nalloc_next_sibling(child[1]) == child[2]);
+    assert(!nalloc_next_sibling(child[2]));
+    assert(nalloc_get_parent(child[2]) == root);
+
+    /* Arrays go behind the siblings too, in order. */
+    assert(nalloc_array(4, 8, root, array) == array);
+    assert(nalloc_next_sibling(child[2]) == array[0]);
+    for (int j = 0; j < 3; j++)
+        assert(nalloc_next_sibling(array[j]) == array[j + 1]);
+    assert(!nalloc_next_sibling(array[3]));
+    assert(nalloc_get_parent(array[3]) == root);
+}
+
+static void test_append(void)
+{
+    void *root = nalloc(8, NULL), *copy, *mem;
+
+    with_each_root(append_below);
+
+    /* Clones keep the mode. */
+    nalloc_set_append(root, 1);
+    nalloc(8, root);
+    copy = nalloc_clone(root, NULL);
+    mem = nalloc(8, copy);
+    assert(!nalloc_next_sibling(mem));
+    assert(nalloc_set_append(root, 0) == 0);
+    mem = nalloc(8, root);
+    assert(nalloc_first_child(root) == mem);
+    nfree(root);
+    nfree(copy);
+}
+
+static void test_defrag(void)
+{
+    void *root = nalloc_arena(8, NULL, 0), *a = nalloc(8, root);
+    void *mem = nalloc(8, root), *b = nalloc(8, root), *copy, *node;
+    void *foreign = nalloc(8, NULL);
+
+    ndestroyed = 0;
+    strcpy(mem, "defrag");
+    for (int i = 0; i < 100; i++)
+        node = nalloc(16, nalloc(8, mem));
+    nalloc_set_parent(foreign, node);
+    nalloc_set_destructor(node, destroy);
+    nalloc_set_destructor(mem, destroy);
+
+    copy = nalloc_defrag(mem);
+    assert(copy && copy != mem && !strcmp(copy, "defrag") && !ndestroyed);
+    assert(nalloc_get_parent(copy) == root);
+    assert(nalloc_next_sibling(b) == copy && nalloc_next_sibling(copy) == a);
+    node = nalloc_first_child(nalloc_first_child(copy));
+    assert(nalloc_first_child(node) && !nalloc_first_child(nalloc_first_child(node)));
+
+    /* The copy is foreign to the arena, and the destructors moved to it. */
+    copy = nalloc_defrag(copy);
+    node = nalloc_first_child(nalloc_first_child(copy));
+    nfree(root);
+    assert(ndestroyed == 2 && destroyed[0] == node && destroyed[1] == copy);
+
+    /* The copy keeps the alignment of aligned chunks, and the arena budget. */
+    root = nalloc_arena(8, NULL, 4096);
+    assert(nalloc_set_limit(root, 3 * 4096, NULL) == 0);
+    strcpy(nalloc_aligned(100, 4096, nalloc_aligned(100, 64, root)), "aligned");
+    root = nalloc_defrag(root);
+    node = nalloc_first_child(root);
+    assert(node && !((uintptr_t)node % 64));
+    node = nalloc_first_child(node);
+    assert(!((uintptr_t)node % 4096) && !strcmp(node, "aligned"));
+    for (int i = 0; i < 100 && (node = nalloc(1000, root)); i++)
+        ;
+    assert(!node);
+    nfree(root);
+
+    root = nalloc_defrag(nalloc(8, NULL));
+    assert(root && !nalloc_defrag(NULL));
+    nfree(root);
+    root = nalloc_compact(8, NULL);
+    assert(!nalloc_defrag(nalloc(8, root)));
+    nfree(root);
+}
+
+static void assert_children(void *parent, void **children, size_t count)
+{
+    void *child = nalloc_first_child(parent);
+
+    for (size_t i = 0; i < count; i++, child = nalloc_next_sibling(child))
+        assert(child == children[i] && nalloc_get_parent(child) == parent);
+    assert(!child);
+}
+
+static void move_range_below(void *root, enum root_kind kind)
+{
+    void *mem[8], *other, *split;
+
+    nalloc_set_append(root, 1);
+    for (int j = 0; j < 8; j++)
+        nalloc(8, mem[j] = nalloc(8, root));
+    other = nalloc(8, root);
+    split = nalloc(8, root);
+    nalloc_set_parent(other, NULL);
+    nalloc_set_parent(split, root);
+
+    /* Middle, tail and head of the list, then all of it. */
+    nalloc_move_range(mem[2], mem[3], split);
+    nalloc_move_range(mem[6], mem[7], split);
+    nalloc_move_range(mem[0], mem[1], split);
+    assert_children(split, (void *[]){ mem[2], mem[3], mem[6], mem[7],
+                                       mem[0], mem[1] }, 6);
+    nalloc_move_range(mem[4], mem[5], split);
+    assert_children(split, (void *[]){ mem[2], mem[3], mem[6], mem[7],
+                                       mem[0], mem[1], mem[4], mem[5] }, 8);
+    assert_children(root, (void *[]){ split }, 1);
+
+    /* The same parent, and another kind of parent. */
+    nalloc_move_range(mem[2], mem[6], split);
+    assert_children(split, (void *[]){ mem[7], mem[0], mem[1], mem[4],
+                                       mem[5], mem[2], mem[3], mem[6] }, 8);
+    if (kind != ROOT_COMPACT) {
+        nalloc_move_range(mem[7], mem[1], other);
+        assert_children(other, (void *[]){ mem[7], mem[0], mem[1] }, 3);
+        nalloc_move_range(mem[4], mem[4], NULL);
+        assert(!nalloc_get_parent(mem[4]));
+        nfree(mem[4]);
+    }
+    nfree(other);
+}
+
+static void test_move_range(void)
+{
+    with_each_root(move_range_below);
+}
+
+static void rollback_below(void *root, enum root_kind kind)
+{
+    void *kept, *mark, *mem, *array[4];
+
+    for (int append = 0; append < 2; append++) {
+        nalloc_set_append(root, append);
+        kept = nalloc(8, root);
+        mark = nalloc_mark(root);
+        assert(mark == kept);
+        for (int j = 0; j < 100; j++)
+            nalloc(8, nalloc(16, root));
+        assert(nalloc_rollback(root, mark) == 0);
+        assert(append ? !nalloc_next_sibling(kept)
+                      : nalloc_first_child(root) == kept);
+
+        /* Rolling back to an empty list frees all the children. */
+        mark = nalloc_mark(kept);
+        assert(!mark);
+        mem = nalloc(8, nalloc(8, kept));
+        assert(nalloc_rollback(kept, mark) == 0);
+        assert(!nalloc_first_child(kept));
+
+        /* Arena space is given back in last carved, first freed order. */
+        if (kind == ROOT_ARENA)
+            assert(nalloc(8, nalloc(8, kept)) == mem);
+    }
+
+    /* Arrays also go behind the siblings, and roll back with them. */
+    mark = nalloc_mark(root);
+    assert(nalloc_array(4, 8, root, array) == array);
+    assert(nalloc_next_sibling(mark) == array[0]);
+    assert(nalloc_rollback(root, mark) == 0);
+    assert(!nalloc_next_sibling(mark));
+
+    /* A mark moved away since then leaves the children alone. */
+    mem = nalloc(8, root);
+    nalloc_set_parent(mark, mem);
+    assert(nalloc_rollback(root, mark) == -1);
+    assert(nalloc_mark(root) == mem && nalloc_first_child(mem) == mark);
+}
+
+static void test_rollback(void)
+{
+    void *root = nalloc(8, NULL), *mark, *mem;
+
+    with_each_root(rollback_below);
+
+    /* So does a mark freed since then. */
+    nalloc(8, root);
+    mark = nalloc_mark(root);
+    mem = nalloc(8, root);
+    nfree(mark);
+    assert(nalloc_rollback(root, mark) == -1);
+    assert(nalloc_first_child(root) == mem && !nalloc_next_sibling(mem));
+    nfree(root);
+    assert(nalloc_rollback(NULL, NULL) == -1);
+}
+
+static size_t npressure;
+
+static void pressure(void *root, size_t used, size_t size)
+{
+    assert(used + size > 3 * 4096);
+    if (npressure++ == 0)
+        nalloc_set_limit(root, used + size, pressure);
+}
+
+static void test_limit(void)
+{
+    void *root = nalloc_arena(16, NULL, 4096), *other = nalloc(16, NULL), *mem;
+    size_t count = 0;
+
+    assert(nalloc_set_limit(root, 3 * 4096, NULL) == 0);
+    while (nalloc(1000, root))
+        count++;
+    assert(count >= 8 && count < 12);
+    assert(!nalloc(10000, root));
+
+    /* The pressure callback can make room once. */
+    assert(nalloc_set_limit(root, 3 * 4096, pressure) == 0);
+    assert(nalloc(1000, root) && npressure == 1);
+    while (nalloc(1000, root))
+        count++;
+    assert(npressure == 2);
+
+    /* Without a limit, the arena grows again. */
+    assert(nalloc_set_limit(root, 0, NULL) == 0);
+    assert((mem = nalloc(10000, root)));
+    assert(nrealloc(mem, 100000));
+    assert(nalloc_set_limit(mem, 4096, NULL) == -1);
+    assert(nalloc_set_limit(other, 4096, NULL) == -1);
+    nfree(other);
+    nfree(root);
+}
+
+static void *clone_source;
+
+static void *nest_arena(void *parent) { return nalloc_arena(16, parent, 8192); }
+static void *nest_compact(void *parent) { return nalloc_compact(16, parent); }
+static void *nest_aligned(void *parent) { return nalloc_aligned(6000, 4096, parent); }
+static void *nest_clone(void *parent) { return nalloc_clone(clone_source, parent); }
+
+static void test_limit_nested(void)
+{
+    struct { void *(*nest)(void *parent); size_t bytes; } cases[] = {
+        { nest_arena, 8192 }, { nest_compact, 1 << 20 },
+        { nest_aligned, 10240 }, { nest_clone, 8192 },
+    };
+    void *root, *mem;
+
+    clone_source = nalloc(6000, NULL);
+    for (int i = 0; i < 4; i++) {
+        /* Room for one of them next to the first block of the arena. */
+        root = nalloc_arena(16, NULL, 4096);
+        assert(nalloc_set_limit(root, 4096 + cases[i].bytes * 3 / 2, NULL) == 0);
+        assert((mem = cases[i].nest(root)) && !cases[i].nest(root));
+
+        /* Freeing it or moving it out gives the room back. */
+        nfree(mem);
+        assert((mem = cases[i].nest(nalloc(16, root))));
+        nalloc_set_parent(mem, NULL);
+        assert(cases[i].nest(root));
+        nalloc_set_parent(mem, root);
+        assert(!cases[i].nest(root));
+        nfree(root);
+    }
+    nfree(clone_source);
+
+    /* What they get later counts too, through the arenas in between. */
+    root = nalloc_arena(16, NULL, 4096);
+    assert(nalloc_set_limit(root, 5 * 4096, NULL) == 0);
+    mem = nalloc_arena(16, nalloc_arena(16, root, 4096), 4096);
+    assert(mem && !nalloc(10000, mem) && nalloc(1000, mem));
+    assert((mem = nalloc_aligned(100, 4096, root)) && !nrealloc(mem, 8000));
+    assert(nalloc_set_limit(root, 0, NULL) == 0);
+    assert(nrealloc(mem, 8000));
+    nfree(root);
+}
+
+static int walk_pre(void *mem, void *ctx)
+{
+    size_t *order = ctx;
+
+    *(size_t *)mem = order[0]++;
+    return mem == (void *)order[2];
+}
+
+static void walk_post(void *mem, void *ctx)
+{
+    size_t *order = ctx;
+
+    assert(*(size_t *)mem < order[0]);
+    order[1]++;
+}
+
+static void test_walk(void)
+{
+    void *root = nalloc(8, NULL), *a = nalloc(8, root), *b = nalloc(8, root);
+    void *c = nalloc(8, a), *compact = nalloc_compact(8, b), *d, *e;
+    size_t order[3] = { 0, 0, 0 };
+
+    d = nalloc(8, compact);
+    e = nalloc(8, compact);
+    assert(nalloc_first_child(root) == b && nalloc_next_sibling(b) == a);
+    assert(!nalloc_next_sibling(a) && !nalloc_next_sibling(root));
+    assert(nalloc_first_child(compact) == e && nalloc_next_sibling(e) == d);
+    assert(!nalloc_first_child(c) && !nalloc_first_child(NULL));
+
+    nalloc_walk(root, walk_pre, walk_post, order);
+    assert(order[0] == 7 && order[1] == 7);
+    assert(*(size_t *)b == 1 && *(size_t *)compact == 2);
+    assert(*(size_t *)e == 3 && *(size_t *)d == 4);
+    assert(*(size_t *)a == 5 && *(size_t *)c == 6);
+
+    /* Skip the children of the compact root. */
+    order[0] = order[1] = 0;
+    order[2] = (size_t)compact;
+    nalloc_walk(root, walk_pre, walk_post, order);
+    assert(order[0] == 5 && order[1] == 5);
+    nalloc_walk(a, NULL, NULL, NULL);
+    nfree(root);
+}
+
+static void test_stats(void)
+{
+    void *root = nalloc(10, NULL), *mem = root, *compact;
+    struct nalloc_stats stats;
+
+    nalloc_subtree_stats(NULL, &stats);
+    assert(!stats.nodes && !stats.bytes);
+    nalloc_subtree_stats(root, &stats);
+    assert(stats.nodes == 1 && stats.bytes == 10);
+    assert(!stats.depth && !stats.fanout);
+
+    for (int i = 0; i < 100000; i++)
+        mem = nalloc(1, mem);
+    for (int i = 0; i < 1000; i++)
+        nalloc(2, root);
+
+    compact = nalloc_compact(4, mem);
+    for (int i = 0; i < 5; i++)
+        nalloc(3, nalloc(3, compact));
+
+    nalloc_subtree_stats(root, &stats);
+    assert(stats.nodes == 1 + 100000 + 1000 + 1 + 10);
+    assert(stats.bytes == 10 + 100000 + 2000 + 4 + 30);
+    assert(stats.depth == 100000 + 3 && stats.fanout == 1001);
+
+    nalloc_subtree_stats(compact, &stats);
+    assert(stats.nodes == 11 && stats.depth == 2 && stats.fanout == 5);
+    nfree(root);
+}
+
+static char hooked_line[64];
+
+/* Record the profile of the chunk the hook is called for. */
+static void on_tagged(void *mem, size_t size)
+{
+    FILE *fp = tmpfile();
+
+    assert(nalloc_dump_profile(mem, fp) == 0);
+    assert(fgets(hooked_line, sizeof(hooked_line), (rewind(fp), fp)));
+    fclose(fp);
+}
+
+static void test_profile(void)
+{
+    struct nalloc_counters before, after;
+    void *root = nalloc(10, NULL), *mem = root, *parser, *site, *compact;
+    char buf[4096], line[256];
+    FILE *fp = tmpfile();
+    int here;
+    size_t len;
+
+    for (int i = 0; i < 1000; i++)
+        mem = nalloc(1, mem);
+    parser = nalloc_tagged(100, root, "parser");
+    for (int i = 0; i < 10; i++)
+        nalloc(1, parser);
+    assert(nalloc_tagged(7, root, "parser"));
+    site = nalloc_here(50, parser); here = __LINE__;
+    assert(nalloc_tagged(5, site, "parser"));
+    compact = nalloc_compact(4, parser);
+    for (int i = 0; i < 5; i++)
+        assert(nalloc_tagged(3, compact, "compact"));
+    assert(nalloc(8, nalloc_tagged(8, nalloc_arena(16, root, 0), "cache")));
+
+    /* Dumping allocates nothing the counters see. */
+    nalloc_counters(&before);
+    assert(nalloc_dump_profile(root, fp) == 0);
+    nalloc_counters(&after);
+    assert(after.allocs == before.allocs && after.frees == before.frees);
+    len = fread(buf, 1, sizeof(buf) - 1, (rewind(fp), fp));
+    buf[len] = '\0';
+    fclose(fp);
+
+#ifdef NALLOC_PROFILE
+    assert(strstr(buf, "untagged;[1002 chunks] 1026\n"));
+    assert(strstr(buf, "\nparser;[18 chunks] 136\n"));
+    snprintf(line, sizeof(line), "\nparser;%s:%d;[1 chunks] 50\n", __FILE__,
+             here);
+    assert(strstr(buf, line));
+    snprintf(line, sizeof(line), "\nparser;%s:%d;parser;[1 chunks] 5\n",
+             __FILE__, here);
+    assert(strstr(buf, line));
+    assert(strstr(buf, "\ncache;[2 chunks] 16\n"));
+    for (len = 0, mem = buf; (mem = strchr(mem, '\n')); mem = (char *)mem + 1)
+        len++;
+    assert(len == 5);
+#else
+    (void)line;
+    (void)here;
+    assert(!strcmp(buf, "untagged;[1024 chunks] 1233\n"));
+#endif
+
+    assert(nalloc_dump_profile(NULL, stdout) == -1);
+    nfree(root);
+
+    /* Alternately tagged chunks nest frames as deep as their chain. */
+    root = mem = nalloc(1, NULL);
+    for (int i = 0; i < 1000; i++)
+        mem = nalloc_tagged(1, mem, i % 2 ? "odd" : "even");
+    fp = tmpfile();
+    assert(nalloc_dump_profile(root, fp) == 0);
+    rewind(fp);
+    for (int c = len = 0; (c = getc(fp)) != EOF;)
+        len += c == '\n';
+#ifdef NALLOC_PROFILE
+    assert(len == 1001);
+    /* The deepest frame comes last, below all the others. */
+    fseek(fp, -(long)strlen("even;odd;[1 chunks] 1\n"), SEEK_END);
+    assert(fgets(line, sizeof(line), fp));
+    assert(!strcmp(line, "even;odd;[1 chunks] 1\n"));
+#else
+    assert(len == 1);
+#endif
+    fclose(fp);
+    nfree(root);
+
+    /* The hook sees the chunk tagged already. */
+    root = nalloc(1, NULL);
+    nalloc_hooks(on_tagged, NULL);
+    nalloc_tagged(5, root, "hooked");
+    nalloc_hooks(NULL, NULL);
+#if defined(NALLOC_STATS) && defined(NALLOC_PROFILE)
+    assert(!strcmp(hooked_line, "hooked;[1 chunks] 5\n"));
+#elif defined(NALLOC_STATS)
+    assert(!strcmp(hooked_line, "untagged;[1 chunks] 5\n"));
+#else
+    assert(!*hooked_line);
+#endif
+    nfree(root);
+}
+
+static size_t hooked;
+
+static void on_alloc(void *mem, size_t size)
+{
+    hooked += size;
+}
+
+static void on_free(void *mem)
+{
+    hooked--;
+}
+
+static void test_counters(void)
+{
+    struct nalloc_counters before, after;
+    void *root, *mem, *children[10];
+
+    nalloc_hooks(on_alloc, on_free);
+    nalloc_counters(&before);
+
+    root = nalloc(100, NULL);
+    mem = nalloc(10, root);
+    for (int i = 0; i < 10; i++)
+        children[i] = nalloc(1, root);
+    /* Second in the list, nine siblings away from the last one. */
+    nalloc_get_parent(children[8]);
+    nalloc_set_parent(mem, NULL);
+    mem = nrealloc(mem, 20);
+    nalloc_set_parent(mem, root);
+    nalloc_cut(root, NULL);
+    nfree(nalloc_compact(1, mem));
+
+    nalloc_counters(&after);
+    nalloc_hooks(NULL, NULL);
+
+#ifdef NALLOC_STATS
+    assert(after.allocs - before.allocs == 13);
+    assert(after.frees - before.frees == 1);
+    assert(after.reparents - before.reparents == 2);
+    assert(after.lookups - before.lookups == 1);
+#ifndef NALLOC_PARENT
+    assert(after.lookup_steps - before.lookup_steps == 9);
+#endif
+    assert(after.cuts - before.cuts == 1);
+    assert(after.cut_steps - before.cut_steps == 11);
+    assert(after.bytes - before.bytes == 130);
+    assert(hooked == 100 + 10 + 10 + 20 + 1 - 2);
+#else
+    assert(!after.allocs && !after.bytes && !hooked);
+#endif
+
+    /* The cut left the children of root detached. */
+    nfree(root);
+    nfree(mem);
+    for (int i = 0; i < 10; i++)
+        nfree(children[i]);
+}
+
+struct backend { long live, calls; };
+
+static void *backend_malloc(void *ctx, size_t size)
+{
+    ((struct backend *)ctx)->live++;
+    ((struct backend *)ctx)->calls++;
+    return malloc(size);
+}
+
+static void *backend_realloc(void *ctx, void *mem, size_t size)
+{
+    ((struct backend *)ctx)->calls++;
+    return realloc(mem, size);
+}
+
+static void *backend_memalign(void *ctx, size_t align, size_t size)
+{
+    void *mem;
+
+    ((struct backend *)ctx)->live++;
+    ((struct backend *)ctx)->calls++;
+    return posix_memalign(&mem, align, size) ? NULL : mem;
+}
+
+static void backend_free(void *ctx, void *mem)
+{
+    ((struct backend *)ctx)->live--;
+    free(mem);
+}
+
+/* An allocator that keeps what it is given back, to look at it later. */
+struct kept { void *mem[256]; int count; };
+
+static void *kept_malloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static void *kept_realloc(void *ctx, void *mem, size_t size)
+{
+    return realloc(mem, size);
+}
+
+static void *kept_memalign(void *ctx, size_t align, size_t size)
+{
+    void *mem;
+
+    return posix_memalign(&mem, align, size) ? NULL : mem;
+}
+
+static void kept_free(void *ctx, void *mem)
+{
+    struct kept *kept = ctx;
+
+    assert(kept->count < 256);
+    kept->mem[kept->count++] = mem;
+}
+
+static void test_free_nested_arena(void)
+{
+    struct kept kept = { { NULL }, 0 };
+    struct nalloc_allocator ops = {
+        kept_malloc, NULL, kept_realloc, kept_memalign, kept_free, &kept
+    };
+    void *root = nalloc_with(16, NULL, &ops);
+    char *mem = nalloc_arena(16, nalloc(16, root), 0);
+
+    for (int i = 0; i < 1000; i++)
+        strcpy(mem = nalloc(16, mem), "carved");
+
+    /* The blocks go back as they are: hardened builds poison what they walk. */
+    nfree(root);
+    assert(kept.count >= 3 && !strcmp(mem, "carved"));
+    for (int i = 0; i < kept.count; i++)
+        free(kept.mem[i]);
+}
+
+/* The memory policy of a page, or -1 if there is no NUMA support. */
+static int mempolicy(void *mem)
+{
+    int mode = -1;
+
+#ifdef SYS_get_mempolicy
+    if (syscall(SYS_get_mempolicy, &mode, NULL, 0, mem, 2 /* MPOL_F_ADDR */))
+        mode = -1;
+#endif
+    return mode;
+}
+
+static void test_numa_release(void)
+{
+    struct kept kept = { { NULL }, 0 };
+    struct nalloc_allocator ops = {
+        kept_malloc, NULL, kept_realloc, kept_memalign, kept_free, &kept
+    };
+    void *root = nalloc_with(16, NULL, &ops);
+    void *mem = nalloc_arena_on_node(16, root, 4096, 0);
+    int bound = mempolicy(mem) == 1 /* MPOL_PREFERRED */;
+
+    /* The blocks go back to the allocator with the default policy. */
+    for (int i = 0; i < 10; i++)
+        nalloc(1000, mem);
+    nfree(root);
+    assert(kept.count >= 3);
+    for (int i = 0; i < kept.count; i++) {
+        assert(!bound || mempolicy(kept.mem[i]) == 0 /* MPOL_DEFAULT */);
+        free(kept.mem[i]);
+    }
+}
+
+static void test_allocator(void)
+{
+    struct backend a = { 0 }, b = { 0 };
+    struct nalloc_allocator ops_a = {
+        backend_malloc, NULL, backend_realloc, backend_memalign, backend_free,
+        &a
+    }, ops_b = ops_a, incomplete = { 0 };
+    void *root, *mem, *other;
+    char *str;
+
+    ops_b.ctx = &b;
+
+    /* Children, aligned chunks and arena blocks inherit the allocator. */
+    root = nalloc_with(16, NULL, &ops_a);
+    str = ncalloc(100, root);
+    assert(a.live == 2 && !str[99]);
+    strcpy(str, "backend");
+    str = nrealloc(str, 100000);
+    assert(!strcmp(str, "backend") && a.calls == 3);
+    assert(nalloc_aligned(16, 4096, str) && a.live == 3);
+    mem = nalloc_arena(16, root, 0);
+    nalloc(16, nalloc(16, mem));
+    assert(a.live == 4);
+
+    /* The default allocator is used for roots only. */
+    assert(!nalloc_set_allocator(&ops_b));
+    other = nalloc(16, NULL);
+    nalloc(16, other);
+    assert(a.live == 4 && b.live == 2);
+    assert(!nalloc_set_allocator(NULL));
+    nalloc(16, root);
+    assert(a.live == 5 && b.live == 2);
+
+    /* Chunks keep their allocator when moved, or overridden. */
+    mem = nalloc_with(16, other, NULL);
+    nalloc(16, mem);
+    nalloc_set_parent(other, root);
+    assert(nalloc_with(16, root, &ops_b) && b.live == 3 && a.live == 5);
+
+    /* So do the copies made by nalloc_defrag(). */
+    mem = nalloc_defrag(nalloc(16, root));
+    assert(mem && a.live == 6 && b.live == 3);
+
+    nfree(root);
+    assert(!a.live && !b.live);
+
+    assert(nalloc_set_allocator(&incomplete) == -1);
+    assert(!nalloc_with(16, NULL, &incomplete));
+}
+
+static void test_cache(void)
+{
+    void *root = nalloc(16, NULL), *mem = nalloc(40, root);
+
+    nfree(mem);
+#if NALLOC_HARDEN < 3
+    /* Quarantined chunks are not reused right away. */
+    assert(nalloc(36, root) == mem);
+#endif
+    nalloc_cache_limit(0);
+    nfree(root);
+    nalloc_cache_limit(1 << 20);
+    nalloc_cache_trim();
+}
+
+static pthread_barrier_t barrier;
+
+static void *cache_worker(void *arg)
+{
+    void **chunks = arg, *mem;
+    int reused = 0;
+
+    for (int i = 0; i < 100; i++)
+        chunks[i] = nalloc(64, NULL);
+    pthread_barrier_wait(&barrier);
+
+    /* The main thread freed them, they come back through the remote queue. */
+    pthread_barrier_wait(&barrier);
+    mem = nalloc(64, NULL);
+    for (int i = 0; i < 100; i++)
+        reused |= chunks[i] == mem;
+#if NALLOC_HARDEN < 3
+    assert(reused);
+#endif
+    nfree(mem);
+    return NULL;
+}
+
+static void test_thread_cache(void)
+{
+    void *chunks[100];
+    pthread_t thread;
+
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&thread, NULL, cache_worker, chunks);
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < 100; i++)
+        nfree(chunks[i]);
+    pthread_barrier_wait(&barrier);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&barrier);
+    nalloc_cache_trim();
+}
+
+static void *concurrent_worker(void *parent)
+{
+    for (int i = 0; i < 10000; i++) {
+        void *mem = nalloc_concurrent(sizeof(int), parent);
+
+        *(int *)mem = i;
+        assert(nalloc(16, mem));
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    void *parent = nalloc(16, NULL), *arena = nalloc_arena(16, NULL, 0);
+    pthread_t threads[8];
+    int count = 0;
+
+    nalloc_set_append(parent, 1);
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, concurrent_worker, parent);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+
+    for (void *mem = nalloc_first_child(parent); mem;
+         mem = nalloc_next_sibling(mem)) {
+        assert(nalloc_first_child(mem));
+        count++;
+    }
+    assert(count == 8 * 10000);
+    assert(nalloc_get_parent(nalloc_first_child(parent)) == parent);
+
+    /* Unlinking goes through the prev links. */
+    for (void *mem = nalloc_first_child(parent), *next; mem; mem = next) {
+        next = nalloc_next_sibling(mem);
+        nalloc_set_parent(mem, NULL);
+        nfree(mem);
+    }
+    assert(!nalloc_first_child(parent));
+
+    assert(!nalloc_concurrent(16, arena));
+    nfree(arena);
+    nfree(parent);
+}
+
+struct pnode { struct pnode *parent; atomic_int children; };
+static atomic_int npnodes;
+
+/* Destructors run child first, even when the subtrees go to other threads. */
+static void pnode_destroy(void *mem)
+{
+    struct pnode *node = mem;
+
+    assert(!node->children);
+    if (node->parent)
+        node->parent->children--;
+    npnodes--;
+}
+
+static struct pnode *pnode_new(struct pnode *parent)
+{
+    struct pnode *node = nalloc(sizeof(*node), parent);
+
+    node->parent = parent;
+    node->children = 0;
+    if (parent)
+        parent->children++;
+    npnodes++;
+    assert(!nalloc_set_destructor(node, pnode_destroy));
+    return node;
+}
+
+static void test_parallel(void)
+{
+    struct pnode *root = pnode_new(NULL), *mem = root;
+    void *arena;
+
+    for (int i = 0; i < 30; i++) {
+        struct pnode *a = pnode_new(root);
+
+        for (int j = 0; j < 30; j++) {
+            struct pnode *b = pnode_new(a);
+
+            for (int k = 0; k < 30; k++)
+                nalloc(16, pnode_new(b));
+        }
+    }
+    for (int i = 0; i < 10000; i++)
+        mem = pnode_new(mem);
+
+    /* Carved chunks, inside and out of their arena tree. */
+    arena = nalloc_arena(16, nalloc_first_child(root), 0);
+    for (int i = 0; i < 1000; i++)
+        nalloc(16, nalloc(16, arena));
+    nalloc_set_parent(nalloc(16, arena), mem);
+
+    nfree_parallel(root, 4);
+    assert(!npnodes);
+
+    nfree_parallel(nalloc(16, NULL), 4);
+    nfree_parallel(nalloc_arena(16, NULL, 0), 4);
+    nfree_parallel(NULL, 4);
+}
+
+#if NALLOC_HARDEN
+static void double_free(void)
+{
+    void *mem = nalloc(16, NULL);
+
+    nfree(mem);
+    nfree(mem);
+}
+
+static void overflow(void)
+{
+    char *root = nalloc_arena(16, NULL, 0), *a = nalloc(16, root);
+    void *b = nalloc(16, root);
+
+    memset(a, 0, 32);
+    nfree(b);
+}
+
+static void cycle(void)
+{
+    void *root = nalloc(16, NULL);
+
+    nalloc_set_parent(root, nalloc(16, nalloc(16, root)));
+}
+
+static void cut_cycle(void)
+{
+    void *root = nalloc(16, NULL);
+
+    nalloc_cut(root, nalloc(16, nalloc(16, root)));
+}
+
+static void use_after_free(void)
+{
+    char *mem = nalloc(16, NULL);
+
+    nfree(mem);
+    mem[3] = 0;
+    nalloc_cache_trim();
+}
+
+static void test_harden(void)
+{
+    void *root = nalloc_arena(16, NULL, 0);
+    unsigned char *mem = ncalloc(16, root);
+
+    assert(aborts(double_free) && aborts(overflow));
+    assert(aborts(cycle) == (NALLOC_HARDEN >= 2));
+    assert(aborts(cut_cycle) == (NALLOC_HARDEN >= 2));
+    assert(aborts(use_after_free) == (NALLOC_HARDEN >= 3));
+
+    /* Carved chunks stay readable once freed. */
+    nfree(mem);
+    assert(mem[0] == (NALLOC_HARDEN >= 2 ? 0x6b : 0));
+    nfree(root);
+}
+#endif
+
 int main()
 {
     struct matrix *m = matrix_new(4, 4);
     matrix_delete(m);
+    test_links();
+    test_free_large_trees();
+    test_realloc();
+    test_arena();
+    test_numa();
+    test_huge();
+    test_compact();
+    test_aligned();
+    test_array();
+    test_destructor();
+    test_deferred();
+    test_walk();
+    test_stats();
+    test_profile();
+    test_snapshot();
+    test_clone();
+    test_append();
+    test_defrag();
+    test_move_range();
+    test_rollback();
+    test_limit();
+    test_limit_nested();
+    test_counters();
+    test_allocator();
+    test_free_nested_arena();
+    test_numa_release();
+    test_cache();
+    test_thread_cache();
+    test_concurrent();
+    test_parallel();
+#if NALLOC_HARDEN
+    test_harden();
+#endif
     return 0;
 }
@@ -25,12 +25,14 @@
 #define UNUSED __attribute__((unused))
 #define EXPORT __attribute__((visibility("default")))
 #define COLD __attribute__((cold))
+#define prefetch(x) __builtin_prefetch(x)
 #else
 #define likely(x) (x)
 #define unlikely(x) (x)
 #define UNUSED
 #define EXPORT
 #define COLD
+#define prefetch(x) ((void)(x))
 #endif
 
 #endif /* INTERNAL_UTILS_H */